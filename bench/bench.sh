@@ -0,0 +1,18 @@
+#!/bin/sh
+# render benchmark: the bytes of every terminal mode for the canned key
+# scripts, one "bench name=value ..." line per build, script and mode.
+#
+#   tetris    one key every 100 ms of a virtual clock, with gravity
+#   tetris-i  the same keys without gravity (-i)
+#   arhaic-i  arhaic/tetris.c without gravity, keys translated to its
+#             set; its blocks come from rand(), so other games
+SCRIPTS=${*:-bench/play.keys bench/mash.keys}
+
+./tetris --bench $SCRIPTS || exit 1
+./tetris -i --bench $SCRIPTS || exit 1
+for f in $SCRIPTS; do
+  for m in "" v m s c sm sc vc; do
+    { tr '46582' 'jlkiy' < $f; printf q; } |
+      bench/arhaic -i -x $(echo $m | sed 's/./-& /g') | ./tetris --bench-stream arhaic-i $f "$m"
+  done
+done
@@ -0,0 +1,17 @@
+/* Tetris for Terminals - render benchmark
+ *
+ * arhaic/tetris.c is built with -Dread=bench_read for the benchmark:
+ * every key it reads first ends the frame with BENCH_MARK, so that
+ * tetris --bench-stream can count its bytes per frame, see bench.sh.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#define BENCH_MARK 0xff // as in tetris.c
+
+ssize_t bench_read( int fd, void *buf, size_t n ) {
+  putchar( BENCH_MARK );
+  fflush( stdout );
+  return read( fd, buf, n );
+}
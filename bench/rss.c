@@ -0,0 +1,28 @@
+/* Tetris for Terminals - footprint report
+ *
+ * rss command [args]: run the command and print its peak resident set
+ * size in kB to stderr (from wait4()), nothing when it could not run,
+ * see size.sh.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+int main( int argc, char *argv[] ) {
+  struct rusage ru;
+  int status;
+  pid_t pid;
+
+  if (argc < 2) return 2;
+  pid = fork();
+  if (pid == 0) {
+    execv( argv[1], argv+1 );
+    _exit( 127 );
+  }
+  if (pid < 0 || wait4( pid, &status, 0, &ru ) < 0) return 1;
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 127) return 127;
+  fprintf( stderr, "%ld\n", ru.ru_maxrss );
+  return 0;
+}
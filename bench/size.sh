@@ -0,0 +1,19 @@
+#!/bin/sh
+# footprint of the embedded profile (-DTINY) next to the default build,
+# one "size name=value ..." line per build: text/data/bss of the binary
+# and the peak RSS (kB) of a game with the keys of bench/play.keys,
+# where the binary runs here ('-' otherwise). LCC builds (see
+# arhaic/build.sh) are only made when lcc is installed.
+PATH=/riscv32_lcc/lcc/bin/:$PATH
+KEYS=bench/play.keys
+
+builds="tetris tetris-tiny"
+if command -v lcc >/dev/null 2>&1; then
+  lcc -DTINY tetris.c engine.c -o tetris-tiny-lcc && builds="$builds tetris-tiny-lcc"
+fi
+
+for b in $builds; do
+  set -- $(size $b 2>/dev/null | tail -n 1) - - -
+  rss=$( { cat $KEYS; printf q; } | bench/rss ./$b -i 2>&1 >/dev/null )
+  echo "size build=$b text=$1 data=$2 bss=$3 rss_kb=${rss:--}"
+done
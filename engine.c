@@ -0,0 +1,862 @@
+/* Tetris for Terminals - game engine
+ *
+ * The gaming board is stored row-major, one row_t word per row (8, 16
+ * or 32 bits for COLS, see engine.h; bit c = column c), so that whole
+ * rows can be tested and moved at once.
+ * Blocks are tested and copied a row at a time via the block_mask
+ * collision table, which is expanded from rotated_block_pattern once
+ * at startup. See engine.h for the interface.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "engine.h"
+
+// collision masks of every block rotation at every column position
+// (index col+3), with the four block rows already shifted to
+// board columns; positions outside [block_col_min, block_col_max]
+// would put part of the block outside the walls
+#define MASK_COLS (COLS+3)
+static row_t block_mask[7][4][MASK_COLS][4];
+static signed char block_col_min[7][4];
+static signed char block_col_max[7][4];
+
+// top and bottom profile of every block rotation: lowest and highest
+// block row occupied in each of the four block columns (-1 if empty)
+static signed char block_top[7][4][4];
+static signed char block_bottom[7][4][4];
+
+// bit-pattern of the block being expanded by tetris_init_tables(),
+// with one four-bit bitmap stored in the lower nibble of each of
+// these variables
+static unsigned char current_block0;
+static unsigned char current_block1;
+static unsigned char current_block2;
+static unsigned char current_block3;
+
+/* each block in 4 rotations
+ * utility lookup table that returns the bit-patterns of the seven
+ * predefined types (shapes) of Tetris blocks via ROM lookups.
+ * We use a 4x4 matrix packed into two unsigned chars as
+ * (first-row << 4 | second-row), (third-row << 4 | fourth-row).
+ * note on the screen it will be mirrored left-right
+*/
+static const unsigned char rotated_block_pattern[] = {
+  // yellow square 2x2, all rotations the same
+  0x06, //  0:0b 0000 0110
+  0x60, //  1:0b 0110 0000
+
+  0x06, //  2:0b 0000 0110
+  0x60, //  3:0b 0110 0000
+
+  0x06, //  4:0b 0000 0110
+  0x60, //  5:0b 0110 0000
+
+  0x06, //  6:0b 0000 0110
+  0x60, //  7:0b 0110 0000
+
+  // lilac T-shape block
+  //  x
+  // xxx
+  0x4E, //  8:0b 0100 1110
+  0x00, //  9:0b 0000 0000
+
+  0x46, // 10:0b 0100 0110
+  0x40, // 11:0b 0100 0000
+
+  0x0E, // 12:0b 0000 1110
+  0x40, // 13:0b 0100 0000
+
+  0x4C, // 14:0b 0100 1100
+  0x40, // 15:0b 0100 0000
+
+  // cyan 1x4 block
+  0x0F, // 16:0b 0000 1111
+  0x00, // 17:0b 0000 0000
+
+  0x44, // 18:0b 0100 0100
+  0x44, // 19:0b 0100 0100
+
+  0x0F, // 20:0b 0000 1111
+  0x00, // 21:0b 0000 0000
+
+  0x44, // 22:0b 0100 0100
+  0x44, // 23:0b 0100 0100
+
+  // red 2+2 shifted block
+  // xx
+  //  xx
+  0x0C, // 24:0b 0000 1100
+  0x60, // 25:0b 0110 0000
+
+  //  x
+  // xx
+  // x
+  0x02, // 26:0b 0000 0010
+  0x64, // 27:0b 0110 0100
+
+  // xx
+  //  xx
+  0x0C, // 28:0b 0000 1100
+  0x60, // 29:0b 0110 0000
+
+  //  x
+  // xx
+  // x
+  0x02, // 30:0b 0000 0010
+  0x64, // 31:0b 0110 0100
+
+  // green 2+2 shifted block (inverse to red)
+  //  xx
+  // xx
+  0x06, // 32:0b 0000 0110
+  0xC0, // 33:0b 1100 0000
+
+  // x
+  // xx
+  //  x
+  0x04, // 34:0b 0000 0100
+  0x62, // 35:0b 0110 0010
+
+  //  xx
+  // xx
+  0x06, // 36:0b 0000 0110
+  0xC0, // 37:0b 1100 0000
+
+  // x
+  // xx
+  //  x
+  0x04, // 38:0b 0000 0100
+  0x62, // 39:0b 0110 0010
+
+  // blue 3+1 L-shaped block
+  // x.
+  // xxx
+  0x08, // 40:0b 0000 0000
+  0xE0, // 41:0b 1000 1110
+
+  // xx
+  // x.
+  // x
+  0xC8, // 42:0b 0000 1100
+  0x80, // 43:0b 1000 1000
+
+  // xxx
+  //  .x
+  0xE2, // 44:0b 0000 1110
+  0x00, // 45:0b 0010 0000
+
+  //   x
+  //  .x
+  //  xx
+  0x22, // 46:0b 0000 0010
+  0x60, // 47:0b 0010 0110
+
+  // orange 1+3 L-shaped block
+  //  .x
+  // xxx
+  0x02, // 48:0b 0000 0000
+  0xE0, // 49:0b 0010 1110
+
+  // x
+  // x.
+  // xx
+  0x88, // 50:0b 0000 1000
+  0xC0, // 51:0b 1000 1100
+
+  // xxx
+  // x.
+  0xE8, // 52:0b 0000 1110
+  0x00, // 53:0b 1000 0000
+
+  //  xx
+  //  .x
+  //   x
+  0x62, // 54:0b 0000 0110
+  0x20, // 55:0b 0010 0010
+};
+
+
+/**
+ * utility function to calculate (1 << nbits)
+ */
+static unsigned char power_of_two( unsigned char nbits ) {
+  unsigned char mask;
+  
+  mask = (1 << nbits);
+  return mask;	
+}
+
+
+/**
+ * fill the current_block0..3 variables with the bit pattern of the
+ * selected block type (0,1..7).
+ * 
+ * Implementation note: the first version of the code used an array
+ * current_block[4], which made for clean C sources but very clumsy
+ * assembly code after compiling. Switching to four separate variables
+ * with two utility functions reduced the code size and made the program
+ * fit into the 16F627...
+ */
+static void create_rotated_block( unsigned char index, unsigned char rotation ) {
+  unsigned char tmp;
+  unsigned char i;
+  
+  i = (index<<3) + ((rotation&3)<<1);
+
+  tmp = rotated_block_pattern[i];
+  current_block0 = (tmp & 0xf0) >> 4;
+  current_block1 = (tmp & 0x0f);
+
+  tmp = rotated_block_pattern[i+1];
+  current_block2 = (tmp & 0xf0) >> 4;
+  current_block3 = (tmp & 0x0f);
+}
+
+
+/**
+ * helper function to access one nibble (row) of the current block.
+ */
+static unsigned char getBlockNibble( unsigned char i ) {
+  unsigned char tmp = 0;
+  switch( i ) {
+       case 0: tmp = current_block0; break;
+       case 1: tmp = current_block1; break;
+       case 2: tmp = current_block2; break;
+       case 3: tmp = current_block3; break;
+  }
+  return tmp;
+}
+
+
+/**
+ * check whether the current block has a pixel at position(row,col)
+ */
+static bit getBlockPixel( unsigned char row, unsigned char col ) {
+  //return (current_block[row] & power_of_two(col) != 0;
+  unsigned char tmp;
+  tmp = getBlockNibble( row );
+  return (tmp & power_of_two(col)) != 0;
+}
+
+
+/**
+ * expand rotated_block_pattern into the block_mask collision table,
+ * once at startup.
+ */
+void tetris_init_tables( void ) {
+  unsigned char index, rotation, i;
+  signed char col;
+  unsigned char nibble[4];
+  unsigned int bits, lost;
+
+  for( index=0; index < 7; index++ )
+    for( rotation=0; rotation < 4; rotation++ ) {
+      create_rotated_block( index, rotation );
+      for( i=0; i < 4; i++ )
+        nibble[i] = getBlockNibble(i);
+      for( col=0; col < 4; col++ ) {
+        block_top[index][rotation][col] = -1;
+        block_bottom[index][rotation][col] = -1;
+        for( i=0; i < 4; i++ )
+          if (getBlockPixel(i,col)) {
+            if (block_top[index][rotation][col] < 0) block_top[index][rotation][col] = i;
+            block_bottom[index][rotation][col] = i;
+          }
+      }
+      block_col_min[index][rotation] = COLS;
+      block_col_max[index][rotation] = -3;
+      for( col=-3; col < COLS; col++ ) {
+        lost = 0;
+        for( i=0; i < 4; i++ ) {
+          bits = nibble[i];
+          if (col < 0) {
+            lost |= bits & ((1 << -col) - 1);
+            bits >>= -col;
+          }
+          else
+            bits <<= col;
+          lost |= bits & ~FULL_ROW;
+          block_mask[index][rotation][col+3][i] = bits & FULL_ROW;
+        }
+        if (lost) continue; // part of the block outside the walls
+        if (col < block_col_min[index][rotation]) block_col_min[index][rotation] = col;
+        block_col_max[index][rotation] = col;
+      }
+    }
+}
+
+
+/**
+ * the four board rows covered by block b at its position, bit c is
+ * column c. Only valid for positions that passed the fit test.
+ */
+const row_t *tetris_block_rows( const struct tetris_block *b ) {
+  return block_mask[b->index][b->rotation][b->col+3];
+}
+
+
+/**
+ * check whether the gaming board position at (row,col) is occupied.
+ */
+bit tetris_occupied( const struct tetris *t, unsigned char row, unsigned char col ) {
+  return (t->board[row] >> col) & 1;
+}
+
+
+/**
+ * the type (block index) of the block an occupied cell came from.
+ */
+unsigned char tetris_cell_index( const struct tetris *t, unsigned char row, unsigned char col ) {
+  return ((t->planes[0][row] >> col) & 1)
+       | ((t->planes[1][row] >> col) & 1) << 1
+       | ((t->planes[2][row] >> col) & 1) << 2;
+}
+
+
+/**
+ * clear the whole gaming board.
+ */
+static void clear_board( struct tetris *t ) {
+  unsigned char r;
+  memset( t->board, 0, ROWS*sizeof(row_t) );
+  for( r=ROWS; r < ROWS+FLOOR_ROWS; r++ )
+    t->board[r] = FULL_ROW;
+  memset( t->skyline, ROWS, sizeof(t->skyline) );
+}
+
+
+/**
+ * next number of the xorshift generator at *state (never 0), the
+ * same sequence with every compiler and libc.
+ */
+uint32_t tetris_random( uint32_t *state ) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+
+/**
+ * random number 0..n-1 (n small): the top 16 bits scaled by n,
+ * a multiply and a shift instead of a division or a retry loop.
+ */
+static unsigned char random_below( struct tetris *t, unsigned char n ) {
+  return (tetris_random(&t->rand_state) >> 16) * n >> 16;
+}
+
+
+/**
+ * one step of a Fisher-Yates shuffle of the inactive pool, step
+ * pool_index of the 7 while the active pool is used: swap position
+ * 6-pool_index with a random one at or below it. The last step
+ * keeps the same piece from appearing twice when switching pools;
+ * another random position is drawn and swapped with position 0 only
+ * when that holds the last piece of the active pool.
+ */
+static void shuffle_inactive_pool( struct tetris *t )
+{
+  unsigned char *pool, i, j, tmp;
+
+  pool = t->shuffled_pool[t->active_pool ^ 1];
+  i = 6 - t->pool_index;
+  if (i > 0)
+    j = random_below(t, i+1);
+  else
+  {
+    i = 1 + random_below(t, 6);
+    j = pool[0] == t->shuffled_pool[t->active_pool][6] ? 0 : i;
+  }
+  tmp = pool[i];
+  pool[i] = pool[j];
+  pool[j] = tmp;
+}
+
+
+/**
+ * create fair-random new block
+ * from the active shuffled pool
+ */
+static void create_random_block( struct tetris *t ) {
+  shuffle_inactive_pool(t);
+  t->cur.index = t->shuffled_pool[t->active_pool][t->pool_index];
+  t->cur.rotation = 0;
+  t->cur.row = ROWNEW;
+  t->cur.col = COLNEW;
+  if(++t->pool_index == 7)
+  {
+    t->pool_index = 0;
+    t->active_pool ^= 1;
+  }
+}
+
+
+/**
+ * check whether the current block fits at its position.
+ * Returns 1 if the block fits, and 0 if not.
+ */
+static bit test_if_block_fits( struct tetris *t ) {
+  const row_t *mask, *rows;
+
+  t->fit_tests++;
+  if (t->cur.col < block_col_min[t->cur.index][t->cur.rotation]) return 0; // too far left
+  if (t->cur.col > block_col_max[t->cur.index][t->cur.rotation]) return 0; // too far right
+
+  mask = block_mask[t->cur.index][t->cur.rotation][t->cur.col+3];
+  rows = t->board + t->cur.row; // rows below the floor are full: too low
+  return ((rows[0] & mask[0]) | (rows[1] & mask[1])
+        | (rows[2] & mask[2]) | (rows[3] & mask[3])) == 0;
+}
+
+
+/**
+ * copy the bits from the current block at its current position 
+ * to the gaming board. This means to fix the current 'foreground'
+ * block into the static 'background' gaming-board pattern.
+ */
+static void copy_block_to_gameboard( struct tetris *t ) {
+  const row_t *mask;
+  row_t *rows;
+  unsigned char j;
+  signed char top;
+
+  mask = block_mask[t->cur.index][t->cur.rotation][t->cur.col+3];
+  rows = t->board + t->cur.row;
+  rows[0] |= mask[0];
+  rows[1] |= mask[1];
+  rows[2] |= mask[2];
+  rows[3] |= mask[3];
+
+  for( j=0; j < 4; j++ ) {
+    top = block_top[t->cur.index][t->cur.rotation][j];
+    if (top < 0) continue;
+    if (t->cur.row+top < t->skyline[t->cur.col+j])
+      t->skyline[t->cur.col+j] = t->cur.row+top;
+  }
+}
+
+
+/**
+ * write the type of the current block into the planes of its cells,
+ * as copy_block_to_gameboard() put it into the board. The planes of
+ * empty cells don't matter, they are just overwritten.
+ */
+static void copy_block_to_planes( struct tetris *t ) {
+  const row_t *mask;
+  row_t *rows, bits;
+  unsigned char j, k;
+
+  mask = block_mask[t->cur.index][t->cur.rotation][t->cur.col+3];
+  for( k=0; k < 3; k++ ) {
+    rows = t->planes[k] + t->cur.row;
+    bits = (t->cur.index >> k) & 1 ? FULL_ROW : 0;
+    for( j=0; j < 4 && t->cur.row+j < ROWS; j++ )
+      rows[j] = (rows[j] & ~mask[j]) | (bits & mask[j]);
+  }
+}
+
+
+/**
+ * return the number of empty rows on top of the stack.
+ */
+static unsigned char stack_top( const struct tetris *t ) {
+  unsigned char c, top;
+
+  top = ROWS;
+  for( c=0; c < COLS; c++ )
+    if (t->skyline[c] < top) top = t->skyline[c];
+  return top;
+}
+
+
+/**
+ * return the lowest row the current block can drop to from its
+ * current position, directly from the skyline and the bottom profile.
+ * Only a block that was moved below an overhang needs probing.
+ */
+static signed char landing_row( struct tetris *t ) {
+  unsigned char j;
+  signed char bottom, row, land, from;
+
+  land = ROWS;
+  for( j=0; j < 4; j++ ) {
+    bottom = block_bottom[t->cur.index][t->cur.rotation][j];
+    if (bottom < 0) continue;
+    row = t->skyline[t->cur.col+j] - 1 - bottom;
+    if (row < land) land = row;
+  }
+  if (land >= t->cur.row) return land;
+
+  // below an overhang, probe down from the current row
+  from = t->cur.row;
+  land = from;
+  for( t->cur.row++; test_if_block_fits(t); t->cur.row++ )
+    land = t->cur.row;
+  t->cur.row = from;
+  return land;
+}
+
+
+/**
+ * check whether the specified game-board row (0=top,ROWS-1=bottom)
+ * is complete (all bits set) or not.
+ */
+static bit is_complete_row( const struct tetris *t, unsigned char r ) {
+  return t->board[r] == FULL_ROW;
+}
+
+
+/**
+ * remove one (presumed complete) row from the game-board,
+ * so that all rows above the specified row drop one level.
+ */
+static void remove_row( struct tetris *t, unsigned char row ) {
+  unsigned char c, r;
+
+  memmove( t->board+1, t->board, row*sizeof(row_t) );
+  t->board[0] = 0; // finally, clear topmost row
+
+  for( c=0; c < COLS; c++ ) {
+    if (t->skyline[c] < row)
+      t->skyline[c]++; // top cell dropped with the rows above
+    else { // top cell was in the removed row, find the next one below
+      for( r=row+1; r < ROWS && !tetris_occupied(t,r,c); r++ )
+        ;
+      t->skyline[c] = r;
+    }
+  }
+}
+
+
+/**
+ * remove the rows listed in cleared[] from the planes too, as
+ * remove_row() did from the board.
+ */
+static void remove_plane_rows( struct tetris *t ) {
+  unsigned char i, k;
+
+  for( i=0; i < t->cleared_n; i++ )
+    for( k=0; k < 3; k++ )
+      memmove( t->planes[k]+1, t->planes[k], t->cleared[i]*sizeof(row_t) );
+}
+
+
+/**
+ * check for completed rows and remove them from the gaming board,
+ * the removed rows are listed in cleared[].
+ */
+static unsigned char check_remove_completed_rows( struct tetris *t ) {
+  unsigned char r;
+
+  t->cleared_n = 0;
+  for( r=0; r < ROWS; r++ ) {
+    if (is_complete_row(t, r)) {
+      t->cleared[t->cleared_n++] = r;
+      remove_row( t, r );
+      t->score += SCORE_PER_ROW*(t->level+1);
+      if(++t->lines == 4)
+      {
+        t->lines = 0;
+        if(t->level < t->max_level)
+        {
+          t->level++;
+          t->step_ms = STEP_FASTER(t->step_ms); // 3/4 times game speedup
+        }
+      }
+    }
+  }
+
+  t->free_rows = stack_top(t);
+  return t->cleared_n ? EV_ROWS | EV_SCORE : 0;
+}
+
+
+/**
+ * start the random sequence of the blocks, the next games go on with
+ * it. The same seed gives the same blocks.
+ */
+void tetris_seed( struct tetris *t, uint32_t seed ) {
+  t->rand_state = seed * 2654435769u + 1;
+  if (t->rand_state == 0) t->rand_state = 1;
+}
+
+
+/**
+ * start a new game: empty board, fresh randomizer pools,
+ * first block on top.
+ */
+void tetris_new_game( struct tetris *t, unsigned char max_level ) {
+  unsigned char i;
+
+  clear_board(t);
+  t->free_rows = ROWS;
+
+  for(i = 0; i < 7; i++)
+    t->shuffled_pool[0][i] = t->shuffled_pool[1][i] = i;
+  // shuffle pool 0 completely, pool 1 follows while pool 0 is used
+  t->active_pool = 1;
+  for(t->pool_index = 0; t->pool_index < 6; t->pool_index++)
+    shuffle_inactive_pool(t);
+  t->active_pool = 0;
+  t->pool_index = 0;
+  create_random_block(t);
+
+  t->cleared_n = 0;
+  t->score = 0;
+  t->lines = 0;
+  t->level = 1;
+  t->max_level = max_level;
+  t->step_ms = MS_STEP_START; // level 1 step 1 s -> level 9 step 0.1 s
+}
+
+
+/**
+ * try to move the current block left.
+ */
+unsigned char tetris_left( struct tetris *t ) {
+  t->cur.col --;
+  if (test_if_block_fits(t)) return EV_MOVED;
+  
+  // if we arrive here, the block doesn't fit,
+  // and we simply undo the column change.
+  t->cur.col ++;	
+  return 0;
+}
+
+
+/**
+ * try to move the current block right.
+ */
+unsigned char tetris_right( struct tetris *t ) {
+  t->cur.col++;
+  if (test_if_block_fits(t)) return EV_MOVED;
+  
+  // if we arrive here, the block doesn't fit,
+  // and we simply undo the column change.
+  t->cur.col --;	
+  return 0;
+}	
+
+
+/**
+ * try to rotate the current block by r quarter turns.
+ */
+unsigned char tetris_rotate( struct tetris *t, char r ) {
+  unsigned char rotation;
+
+  rotation = t->cur.rotation;
+  t->cur.rotation = (rotation+r)&3;
+  if (test_if_block_fits(t)) return EV_MOVED;
+  
+  // if we arrive here, the block doesn't fit,
+  // and we undo the rotation
+  t->cur.rotation = rotation;
+  return 0;
+}
+
+
+/**
+ * attempt to move the current block one position down.
+ * If it doesn't fit, copy the current block to the gaming board
+ * (it is still described in locked) and check for completed rows.
+ * Finally, we create a new random block.
+ */
+unsigned char tetris_down( struct tetris *t ) {
+  unsigned char ev;
+
+  t->cur.row++;
+  if (test_if_block_fits(t)) return EV_MOVED; // fits
+  
+  ev = EV_LOCKED | EV_NEW_BLOCK | EV_SCORE;
+  if (t->cur.row <= ROWNEW+2) { // already stuck right on top
+    ev |= EV_GAME_OVER;
+  }
+  
+  // if we arrive here, the block doesn't fit,
+  // and we have to copy it to the game board.
+  // we also need a new random block...
+  t->cur.row--;
+  t->locked = t->cur;
+  copy_block_to_gameboard(t);
+  copy_block_to_planes(t);
+  ev |= check_remove_completed_rows(t);
+  remove_plane_rows(t); // here, not in the two above: the planner has no planes
+
+  create_random_block(t);
+  t->score += SCORE_PER_BLOCK*(t->level+1);
+  return ev;
+}
+
+
+/**
+ * drop the current block to the lowest row it fits in, it is not
+ * stuck yet: the next tetris_down() does that.
+ */
+unsigned char tetris_drop( struct tetris *t ) {
+  signed char row;
+
+  row = landing_row(t);
+  if (row == t->cur.row) return 0;
+  t->cur.row = row;
+  return EV_MOVED;
+}
+
+
+/*
+ * autoplay: try every placement of the current block that can be
+ * reached by rotating and then moving it sideways where it is, and for
+ * each one every placement of the next block, and pick the one that
+ * leaves the best board. A board is rated on its aggregate height,
+ * holes and bumpiness, all counted for the whole row at once from the
+ * row bit masks, and on the rows completed.
+ */
+#define PLAN_HEIGHT  (-51)  // per occupied-or-covered cell height
+#define PLAN_LINES     76   // per completed row
+#define PLAN_HOLES   (-356) // per empty cell below the top of its column
+#define PLAN_BUMPS   (-18)  // per height step between neighbour columns
+#define PLAN_LOST    (-1000000) // the game would end
+
+#define PLACEMENTS (4*(COLS+3))
+
+// the games tried are copies without the planes, they are not needed
+// here and would take most of the time to copy
+#define PLAN_COPY(to, from) memcpy((to), (from), offsetof(struct tetris, planes))
+
+
+/**
+ * the number of set bits in row x.
+ */
+static unsigned char row_bits( row_t x ) {
+#if COLS <= 16
+  uint16_t v = x;
+
+  v = v - ((v >> 1) & 0x5555);
+  v = (v & 0x3333) + ((v >> 2) & 0x3333);
+  v = (v + (v >> 4)) & 0x0f0f;
+  return (v + (v >> 8)) & 0x1f;
+#else
+  uint32_t v = x;
+
+  v = v - ((v >> 1) & 0x55555555);
+  v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+  v = (v + (v >> 4)) & 0x0f0f0f0f;
+  v = v + (v >> 8);
+  return (v + (v >> 16)) & 0x3f;
+#endif
+}
+
+
+/**
+ * rate the board, top to bottom with cover the columns that are occupied
+ * at or above the row: a hole is an empty cell under cover, the height
+ * of a column is the number of rows it is covered in, and neighbour
+ * columns differ in height by the rows where one is covered and the
+ * other one not.
+ */
+static int rate_board( const struct tetris *t ) {
+  row_t cover, row;
+  int height, holes, bumps;
+  unsigned char r;
+
+  cover = 0;
+  height = holes = bumps = 0;
+  for( r = stack_top(t); r < ROWS; r++ ) {
+    row = t->board[r];
+    holes += row_bits(cover & ~row);
+    cover |= row;
+    height += row_bits(cover);
+    bumps += row_bits((cover ^ (cover >> 1)) & (FULL_ROW >> 1));
+  }
+  return PLAN_HEIGHT*height + PLAN_HOLES*holes + PLAN_BUMPS*bumps;
+}
+
+
+/**
+ * list the positions the current block lands in when rotated (as with
+ * tetris_rotate(t, 1)) and moved left or right where it is, then
+ * dropped. Returns the number of positions.
+ */
+static unsigned char placements( struct tetris *t, struct tetris_block *list ) {
+  struct tetris_block from;
+  unsigned char n, r;
+  signed char dir;
+
+  from = t->cur;
+  n = 0;
+  for( r = 0; r < 4; r++ ) {
+    if (r > 0 && !tetris_rotate(t, 1)) break;
+    for( dir = -1; dir <= 1; dir += 2 ) {
+      t->cur.col = from.col;
+      if (dir > 0) t->cur.col += dir; // the middle one went with the left
+      for( ; test_if_block_fits(t); t->cur.col += dir ) {
+        list[n] = t->cur;
+        list[n].row = landing_row(t);
+        n++;
+      }
+    }
+    t->cur.col = from.col;
+  }
+  t->cur = from;
+  return n;
+}
+
+
+/**
+ * put the current block at position b in the board of t (a copy),
+ * remove the completed rows and rate the board, or PLAN_LOST.
+ */
+static int rate_placement( struct tetris *t, const struct tetris_block *b ) {
+  if (b->row <= ROWNEW+1) return PLAN_LOST; // stuck on top, see tetris_down()
+  t->cur = *b;
+  copy_block_to_gameboard(t);
+  check_remove_completed_rows(t);
+  return PLAN_LINES*t->cleared_n;
+}
+
+
+/**
+ * find the best position for the current block, looking at the next
+ * block too, as the rotation (0..3) and column it should be dropped
+ * from. Returns 0 when there is no position that doesn't end the game.
+ */
+bit tetris_plan( const struct tetris *t, struct tetris_block *move ) {
+  struct tetris_block first[PLACEMENTS], second[PLACEMENTS];
+  struct tetris a, b, c;
+  unsigned char i, j, n, m;
+  int rate, rate1, best, best2;
+
+  PLAN_COPY(&a, t);
+  n = placements(&a, first);
+  best = PLAN_LOST;
+  for( i = 0; i < n; i++ ) {
+    PLAN_COPY(&b, t);
+    rate1 = rate_placement(&b, &first[i]);
+    if (rate1 == PLAN_LOST) continue;
+
+    // the next block, as create_random_block() takes it
+    b.cur.index = b.shuffled_pool[b.active_pool][b.pool_index];
+    b.cur.rotation = 0;
+    b.cur.row = ROWNEW;
+    b.cur.col = COLNEW;
+    best2 = PLAN_LOST;
+    if (test_if_block_fits(&b)) {
+      m = placements(&b, second);
+      for( j = 0; j < m; j++ ) {
+        PLAN_COPY(&c, &b);
+        rate = rate_placement(&c, &second[j]);
+        if (rate == PLAN_LOST) continue;
+        rate += rate_board(&c);
+        if (rate > best2) best2 = rate;
+      }
+    }
+    if (best2 == PLAN_LOST) best2 = rate_board(&b) + PLAN_LOST/2; // lost next
+    rate = rate1 + best2;
+    if (rate > best) {
+      best = rate;
+      *move = first[i];
+    }
+  }
+  return best != PLAN_LOST;
+}
@@ -0,0 +1,126 @@
+/* Tetris for Terminals - game engine
+ *
+ * The rules of the game without any output: the gaming board, the
+ * current block, scoring and levels. All state of one game is kept in
+ * a struct tetris, so that any number of games can run in one process.
+ * The step functions return a set of EV_* render events telling the
+ * caller what changed, a terminal front-end (tetris.c) repaints from
+ * these, a simulation just ignores them.
+ *
+ * The collision tables are shared by all games, call tetris_init_tables()
+ * once before anything else. Games don't share any other state, each
+ * has its own random sequence (tetris_seed()), so they can also run on
+ * several threads. The random numbers are the same on every platform.
+ */
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stdint.h>
+
+// the size of the board is fixed at build time (-DROWS=16 -DCOLS=8),
+// so that the row masks, loop bounds and tables are constants for it
+#ifndef ROWS
+#define ROWS  24
+#endif
+#ifndef COLS
+#define COLS  10
+#endif
+#if ROWS < 8 || ROWS > 64 || COLS < 4 || COLS > 22
+#error "boards have 8..64 rows and 4..22 columns (80 terminal columns)"
+#endif
+
+#define ROWNEW 0          // ROW in memory where new piece appears
+#define COLNEW (COLS/2-2) // COL in memory where new piece appears
+
+// the gaming board is followed by always full rows below the floor,
+// so that the fit test needs no range check for the bottom
+#define FLOOR_ROWS 4
+
+// starts game with step 1 s at level 1, it's a longest step time
+#define MS_STEP_START 1000
+#define STEP_FASTER(x) x*3/4
+//#define MS_STEP_START 100
+//#define STEP_FASTER(x) x
+
+// high-scores: 1 point per new block, 20 points per completed row
+#define SCORE_PER_BLOCK  ((unsigned char) 1)
+#define SCORE_PER_ROW    ((unsigned char) 20)
+
+// render events returned by the step functions
+#define EV_MOVED      0x01 // current block moved or rotated
+#define EV_LOCKED     0x02 // block stuck in the board, see locked
+#define EV_ROWS       0x04 // completed rows removed, see cleared
+#define EV_SCORE      0x08 // score or level changed
+#define EV_NEW_BLOCK  0x10 // a new current block appeared
+#define EV_GAME_OVER  0x20 // the stack reached the top
+
+typedef unsigned char bit; // compatiblity
+
+// one board row, bit c is column c, in the narrowest word for COLS
+#if COLS <= 8
+typedef uint8_t row_t;
+#elif COLS <= 16
+typedef uint16_t row_t;
+#else
+typedef uint32_t row_t;
+#endif
+#define FULL_ROW ((row_t) ((1UL << COLS) - 1))
+
+// a block of type index (0..6) in one of four rotations, its 4x4
+// bitmap has the top left corner at board position (row, col)
+struct tetris_block {
+  unsigned char index;
+  unsigned char rotation;
+  signed char row;
+  signed char col;
+};
+
+struct tetris {
+  row_t board[ROWS+FLOOR_ROWS];  // the main game-board, bit set: occupied
+  unsigned char skyline[COLS];   // row of the topmost occupied cell (ROWS if empty)
+  unsigned char free_rows;       // empty rows on top of the stack
+
+  struct tetris_block cur;       // the current (falling) block
+  struct tetris_block locked;    // last block stuck in the board (EV_LOCKED)
+  unsigned char cleared[4];      // rows removed by the last lock (EV_ROWS),
+  unsigned char cleared_n;       // top to bottom
+
+  unsigned char lines;           // rows completed on this level
+  unsigned char level;
+  unsigned char max_level;
+  unsigned int  score;
+  long step_ms;                  // time step of the piece to fall one tile
+
+  // 2 fair randomizer pools: the blocks come from the active one while
+  // the other one is shuffled, one step per block
+  unsigned char shuffled_pool[2][7];
+  unsigned char active_pool;     // alternates 0/1
+  unsigned char pool_index;      // 0-7
+  uint32_t rand_state;           // random numbers of this game only
+  unsigned long fit_tests;       // collision tests so far, for statistics
+
+  // last, autoplay doesn't copy them (see tetris_plan())
+  row_t planes[3][ROWS];         // type (index) of the block an occupied cell
+                                 // came from, bit k of it in plane k
+};
+
+void tetris_init_tables( void );
+void tetris_seed( struct tetris *t, uint32_t seed );
+uint32_t tetris_random( uint32_t *state );
+void tetris_new_game( struct tetris *t, unsigned char max_level );
+
+unsigned char tetris_left( struct tetris *t );
+unsigned char tetris_right( struct tetris *t );
+unsigned char tetris_rotate( struct tetris *t, char r );
+unsigned char tetris_down( struct tetris *t );
+unsigned char tetris_drop( struct tetris *t );
+
+// autoplay: where to drop the current block (rotation and column)
+bit tetris_plan( const struct tetris *t, struct tetris_block *move );
+
+bit tetris_occupied( const struct tetris *t, unsigned char row, unsigned char col );
+unsigned char tetris_cell_index( const struct tetris *t, unsigned char row, unsigned char col );
+const row_t *tetris_block_rows( const struct tetris_block *b );
+
+#endif /* ENGINE_H */
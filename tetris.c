@@ -37,8 +37,14 @@
  * with one bit per position (1=occupied 0=empty). All accesses to the
  * gaming board should be via the setPixel() and occupied() functions.
  * A standard gaming board of 24 rows of 10 columns each is used.
+ * On linux the board is stored row-major, one word per row
+ * (bit c = column c), so that whole rows can be tested and moved at once;
+ * other sizes are a build option (ROWS, COLS in engine.h), the row
+ * word is 8, 16 or 32 bits wide for COLS.
  * Note that the decision for a 1-bit representation means that we lose
  * the option to display the original type (color) of the different blocks.
+ * On linux the engine keeps the type in 3 more bit planes beside the
+ * board, so that repainting the board (-s, redraw) keeps the colors.
  * Unfortunately, I found no way to tweak the program into the 16F84
  * via the picclite compiler, so I switched to the pincompatible 16F628.
  * The original 1-bit datastructures were kept, though the 16F628 should
@@ -53,7 +59,10 @@
  * is maintained in the current_row and current_col variables, and the
  * test_if_block_fits() functions checks whether the block fits within the
  * gaming board bounds and the already placed blocks.
- * 
+ * On linux the rules live in engine.c, with all state of a game in one
+ * struct tetris (see engine.h); this file is the terminal front-end that
+ * repaints from the render events the engine step functions return.
+ *
  * The program enables interrupts for both the timer0 interrupts and
  * the serial-port receiver interrupts (user input via the terminal).
  * The interrupt handler just copies the received input character to the
@@ -102,6 +111,7 @@
  * - implement the 'pause' command
  * - make timer0 delays smaller with increasing game level
  * - add high-score list management, could use the data EEPROM
+ *   (on linux: -L file, see leaders_record())
  * - program should run with watchdog timer enabled (needs extra clrwdt)
  * - etc.
  *
@@ -129,82 +139,100 @@
  * 2005.12.27 - first code (game board drawing etc)
  */
 
+/* -DTINY: embedded profile (make size), the game alone on one terminal:
+ * no stdio and no heap, output only by write() from the frame buffer,
+ * no tables built at run time beyond the engine's collision table */
+#ifndef TINY
+#define TINY 0
+#endif
+
+#if !TINY
 #include <stdio.h>
+#endif
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
 #include <termios.h>
+#include <poll.h>
+#include <fcntl.h>
 #ifdef __GNUC__
 #include <sys/ioctl.h>
 #endif
+#include "engine.h"
 
 /* how to wait for key (enable one of) */
-#define USE_TERMIOS  1
+#define USE_TERMIOS  0
 #define USE_SELECT   0
+#define USE_POLL     1 /* ms timeout, termios untouched after init */
 
-// graphics chars printed
-#define CHAR_SPACE  ' '
-#define CHAR_WALL   '|'
-#define CHAR_FLOOR  '|'
-#define CHAR_ACTIVE       block_name[current_index]
-#define CHAR_ACTIVE_FIXED block_name[current_index]
-#define CHAR_FIXED  'X'
+/* -S port: serve many terminals from one process (linux epoll) */
+#define USE_SERVER   !TINY
+
+/* --headless: the engine alone on a virtual clock, for simulations */
+#define USE_HEADLESS !TINY
+
+/* -R/-P file: record a game, play it back or verify it */
+#define USE_REPLAY   !TINY
+
+/* -t: count what the game costs, report at exit and on SIGUSR1 */
+#define USE_STATS    !TINY
 
+/* -L file: the best games of all processes sharing the file */
+#define USE_LEADERS  !TINY
+
+#if USE_HEADLESS
+#include <pthread.h>
+#endif
+
+#if USE_STATS
+#include <signal.h>
+#endif
 
-// 1-single char (for 8x8 font), 2-double char (for 8x16 font) ...
-unsigned char DRAW_multi = 2;
+#if USE_REPLAY || USE_LEADERS
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
-// switch VT100 to VT52 mode and use VT52 controls
-// 0: VT100 default (may have color)
-// 1: VT100->VT52 (no color)
-unsigned char VT52_mode = 0;
+#if USE_SERVER
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
 
-// VT100 color or mono
-// 0: VT100 monochrome
-// 1: VT100 color
-unsigned char VT100_color = 1;
+// graphics chars printed
+#define CHAR_SPACE  ' '
+#define CHAR_WALL   '|'
+#define CHAR_FLOOR  '|'
+#define CHAR_ACTIVE(b)       block_name[(b)->index]
+#define CHAR_ACTIVE_FIXED(b) block_name[(b)->index]
 
-// VT100 terminal scroll
-// 0: redraw board (fixed blocks loose color after scrolling)
-// 1: VT100 scroll (fixed blocks keep color after scrolling)
-unsigned char VT100_scroll = 1;
 
 // max level
 //  9: (default), 0.1s delay between steps
 // 10: difficult, no delay between steps (max terminal speed)
 unsigned char MAX_level = 9;
 
-// infinite time to think where to place a piece
-unsigned char INFINITE_time = 0;
-
 unsigned char EXIT_after_game_over = 1;
 
-typedef unsigned char bit; // compatiblity
-
-struct termios orig_termios, current_termios;
+// the first game has this sequence of blocks, -r: a new one each run
+unsigned int RAND_seed = 1;
 
-long time_now_ms, time_next_ms;
-long step_ms; // time step of the piece to fall one tile
+// -a: the game plays itself (and starts again after game over with -x)
+unsigned char AUTO_play = 0;
 
-// timer wraparounds from 9999 to 0 during 10000 cycles
-#define MS_WRAPAROUND 10000
-// starts game with step 1 s at level 1, it's a longest step time
-#define MS_STEP_START 1000
-#define STEP_FASTER(x) x*3/4
-//#define MS_STEP_START 100
-//#define STEP_FASTER(x) x
+struct termios orig_termios, current_termios;
 
-// timeout should be more than longest step time
+// a step later than this (suspend/resume, stopped process)
+// restarts the step timing instead of catching up,
+// should be more than longest step time
 #define MS_TIMEOUT    (MS_STEP_START+500)
 
-#define ROWS  ((unsigned char) 24) // must be divisible by 8
-#define COLS  ((unsigned char) 10)
-
-#define ROWSD ((unsigned char) 23) // last N rows of active gamefield displayed
+#define ROWSD ((unsigned char) (ROWS-1)) // last N rows of active gamefield displayed
 #define ROW0  (ROWS-ROWSD) // first row displayed
-#define ROWNEW 0 // ROW in memory where new piece appears
-#define COLNEW 3 // COL in memory where new piece appears
 
 #define PAINT_FIXED  ((unsigned char) 2)
 #define PAINT_ACTIVE ((unsigned char) 1)
@@ -213,29 +241,52 @@ long step_ms; // time step of the piece to fall one tile
 #define XOFFSET ((unsigned char) 2)
 #define XLIMIT  ((unsigned char) (XOFFSET+COLS))
 
-#define BOARD_BYTES ((ROWS>>3)*10)
-
-static unsigned char free_rows;
-static unsigned char board[BOARD_BYTES];         // the main game-board
-
-static unsigned char current_index;     // index of the current block (for colorization)
-static unsigned char current_block0;    // bit-pattern of the current block,
-static unsigned char current_block1;    // with one four-bit bitmap stored
-static unsigned char current_block2;    // in the lower nibble of each of these
-static unsigned char current_block3;    // variables
-static unsigned char current_rotation;
-
-static signed char current_row;         // row of the current block
-static signed char current_col;         // col of the current block
-
-static unsigned char lines;
-static unsigned char level;
-static unsigned int  score;
+// level and score right of the board, on the row above the floor:
+// "Level: 01  Score: 000123", 2 + 6 digits
+#define PANEL_ROW (ROWSD-1)
+#define PANEL_COL ((XLIMIT+1)*2+4)
+#define PANEL_DIGITS 8
+#define PANEL_DIGIT_COL(i) ((i) < 2 ? PANEL_COL+7+(i) : PANEL_COL+16+(i))
+
+// output frame buffer, everything drawn during one check_handle_command()
+// is sent with a single write() at the end of the main-loop iteration.
+// With USE_POLL the terminal is non-blocking: what it does not take
+// stays pending (from outbuf_start) and is sent when poll() says so.
+#define OUTBUF_SIZE 4096
+static int stdout_flags;
+
+// flush early when this many bytes are buffered (-f for slow serial links)
+unsigned int OUTBUF_limit = OUTBUF_SIZE;
+
+// link throughput in bytes/s, given with -b baud or measured while the
+// terminal is behind (0: not known yet). When more than a frame budget
+// (what the link sends in FRAME_MS) is still queued, block moves are
+// not drawn, only the latest position once the link has caught up.
+#define FRAME_MS        40
+#define FRAME_RETRY_MS  (FRAME_MS/4)
+#define LINK_SAMPLE_NS  100000000
+
+// shadow copy of what the terminal currently shows in the board area:
+// character and background color of each cell (DRAW_multi chars wide),
+// for the displayed rows plus the floor, up to the right wall
+#define SCREEN_ROWS  (ROWSD+1)
+#define SCREEN_CELLS (XLIMIT+1)
+#define COLOR_DEFAULT 49
+
+// cursor position on the terminal as far as we know,
+// vt100_goto() picks the shortest way from there
+#define CURSOR_UNKNOWN 0xff
+
+// background color last sent, blink is on for colors >= 100
+#define SGR_UNKNOWN 0
 
 #define STATE_IDLE   ((unsigned char) 0x1)
 #define TIMEOUT      ((unsigned char) 0x2)
 #define NEEDS_INIT   ((unsigned char) 0x4) 
 #define GAME_OVER    ((unsigned char) 0x8) 
+#define QUIT         ((unsigned char) 0x10) // player left
+#define MENU         ((unsigned char) 0x20) // choosing options (server)
+#define WATCH        ((unsigned char) 0x40) // spectator of another game (server)
 
 #define CMD_NONE     ((unsigned char) 0)
 #define CMD_LEFT     ((unsigned char) '4')
@@ -248,23 +299,138 @@ static unsigned int  score;
 #define CMD_START    ((unsigned char) 's')
 #define CMD_QUIT     ((unsigned char) 'q')
 #define CMD_CTRLC    ((unsigned char) 'C'-'@')
+#define CMD_TICK     ((unsigned char) 0x80) // step timeout, keys are 7-bit
+
+// commands read from the terminal and step ticks, in arrival order,
+// all handled before the next frame is sent
+#define QUEUE_SIZE 64 // power of 2
 
-// high-scores: 1 point per new block, 20 points per completed row
-#define SCORE_PER_BLOCK  ((unsigned char) 1)
-#define SCORE_PER_ROW    ((unsigned char) 20)
+/**
+ * everything about one player at one terminal: the terminal options,
+ * what the terminal shows, the output buffer, and the game.
+ * The standalone game has one (console), the server (-S) one per
+ * connection; ses points to the one being handled.
+ */
+struct session {
+  int fd; // terminal output
+
+  // 1-single char (for 8x8 font), 2-double char (for 8x16 font) ...
+  unsigned char DRAW_multi;
+
+  // switch VT100 to VT52 mode and use VT52 controls
+  // 0: VT100 default (may have color)
+  // 1: VT100->VT52 (no color)
+  unsigned char VT52_mode;
+
+  // VT100 color or mono
+  // 0: VT100 monochrome
+  // 1: VT100 color
+  unsigned char VT100_color;
+
+  // VT100 terminal scroll
+  // 0: redraw board (fixed blocks loose color after scrolling)
+  // 1: VT100 scroll (fixed blocks keep color after scrolling)
+  unsigned char VT100_scroll;
+
+  // VT100 run compression (not on a real VT100, e.g. xterm, linux console)
+  // 0: every character is sent
+  // 1: runs of equal characters are sent with REP (ESC [ n b) or erased
+  //    with ECH (ESC [ n X)
+  unsigned char VT100_rep;
+
+  // infinite time to think where to place a piece
+  unsigned char INFINITE_time;
+
+  int64_t time_next_ns; // when the piece falls next, on the monotonic clock
+
+  unsigned char outbuf[OUTBUF_SIZE];
+  unsigned int  outbuf_start, outbuf_len;
+
+  unsigned long link_rate;
+  unsigned char link_fixed, link_busy;
+  unsigned char link_queued;       // a write came up short, see vt100_backlog()
+  unsigned long link_total;        // bytes put into outbuf so far
+  unsigned long link_done;         // bytes on the screen at link_time_ns
+  int64_t link_time_ns;
+
+  unsigned char shadow_ch[SCREEN_ROWS][SCREEN_CELLS];
+  unsigned char shadow_color[SCREEN_ROWS][SCREEN_CELLS];
+
+  unsigned char cursor_row;
+  unsigned char cursor_col;
+
+  unsigned char sgr_color;
+
+  // the level and score digits the panel shows, see display_score(),
+  // panel_valid is 0 while the labels have to be painted too
+  unsigned char panel[PANEL_DIGITS];
+  unsigned char panel_valid;
+
+  // run of equal characters drawn by display_cell() but not sent yet,
+  // it ends just before the cursor, see vt100_send_pending()
+  unsigned char pending_ch, pending_n;
+
+  // the game: board, current block, score
+  struct tetris game;
+
+  // the block as the terminal shows it, it lags behind the current
+  // block while block moves are coalesced for a slow link
+  struct tetris_block shown;
+  unsigned char shown_valid;
+  unsigned char active_mode;       // paint mode of the current block
+  unsigned char active_dirty;      // current block not shown yet
+  unsigned char auto_plan;         // autoplay: the new block needs its moves
+
+  unsigned char  state;
+  unsigned char  command;
+
+  unsigned char queue[QUEUE_SIZE];
+  unsigned char queue_head, queue_tail;
+  unsigned char esc_state; // position in an arrow key sequence
+#if USE_STATS
+  int64_t input_ns;        // when the input not painted yet was read
+#endif
+
+#if USE_SERVER
+  unsigned char telnet_state; // position in a telnet command
+  unsigned char epoll_out;    // waiting for the socket to take output
+
+  // timer wheel: the slot list this session is in, and when it is due
+  struct session *wheel_next, **wheel_prev;
+  int64_t wheel_tick;
+
+  struct session *next;       // all connections
+  // spectators: the game watched, and the watchers of this game who
+  // get each frame as it is sent to the player
+  struct session *watch, *watchers, *watch_next;
+  unsigned char watch_behind; // missed frames, a snapshot is due
+  unsigned int  bcast;        // outbuf bytes already sent to the watchers
+#endif
+};
 
-static unsigned char  state;
-static unsigned char  command;
+static struct session console;
+static struct session *ses = &console;
 
-// 2 fair randomizer pools
-unsigned char shuffled_pool[2][7] = { {0,1,2,3,4,5,6}, {0,1,2,3,4,5,6} };
-unsigned char active_pool = 0; // alternates 0/1
-unsigned char pool_index = 0; // 0-7
 
-char *block_name = "OTISZLJ";
+/**
+ * default options and an unknown terminal state for session s,
+ * drawing to fd.
+ */
+void session_init( struct session *s, int fd ) {
+  memset( s, 0, sizeof(*s) );
+  s->fd = fd;
+  s->DRAW_multi = 2;
+  s->VT100_color = 1;
+  s->VT100_scroll = 1;
+  s->cursor_row = CURSOR_UNKNOWN;
+  s->sgr_color = SGR_UNKNOWN;
+}
+
+
+const char block_name[] = "OTISZLJ";
 
 // VT100 block colors (first 8 matters)
-unsigned char index2color[] = {
+const unsigned char index2color[] = {
  103, // yellow box 2x2
  45,  // lilac T-shape
  46,  // cyan straight 1x4
@@ -281,410 +447,351 @@ unsigned char index2color[] = {
  106, // bright cyan
 };
 
-/* each block in 4 rotations
- * utility lookup table that returns the bit-patterns of the seven
- * predefined types (shapes) of Tetris blocks via ROM lookups.
- * We use a 4x4 matrix packed into two unsigned chars as
- * (first-row << 4 | second-row), (third-row << 4 | fourth-row).
- * note on the screen it will be mirrored left-right
-*/
-unsigned char rotated_block_pattern[] = {
-  // yellow square 2x2, all rotations the same
-  0x06, //  0:0b 0000 0110
-  0x60, //  1:0b 0110 0000
-
-  0x06, //  2:0b 0000 0110
-  0x60, //  3:0b 0110 0000
-
-  0x06, //  4:0b 0000 0110
-  0x60, //  5:0b 0110 0000
-
-  0x06, //  6:0b 0000 0110
-  0x60, //  7:0b 0110 0000
-
-  // lilac T-shape block
-  //  x
-  // xxx
-  0x4E, //  8:0b 0100 1110
-  0x00, //  9:0b 0000 0000
-
-  0x46, // 10:0b 0100 0110
-  0x40, // 11:0b 0100 0000
-
-  0x0E, // 12:0b 0000 1110
-  0x40, // 13:0b 0100 0000
-
-  0x4C, // 14:0b 0100 1100
-  0x40, // 15:0b 0100 0000
-
-  // cyan 1x4 block
-  0x0F, // 16:0b 0000 1111
-  0x00, // 17:0b 0000 0000
-
-  0x44, // 18:0b 0100 0100
-  0x44, // 19:0b 0100 0100
-
-  0x0F, // 20:0b 0000 1111
-  0x00, // 21:0b 0000 0000
-
-  0x44, // 22:0b 0100 0100
-  0x44, // 23:0b 0100 0100
-
-  // red 2+2 shifted block
-  // xx
-  //  xx
-  0x0C, // 24:0b 0000 1100
-  0x60, // 25:0b 0110 0000
-
-  //  x
-  // xx
-  // x
-  0x02, // 26:0b 0000 0010
-  0x64, // 27:0b 0110 0100
-
-  // xx
-  //  xx
-  0x0C, // 28:0b 0000 1100
-  0x60, // 29:0b 0110 0000
-
-  //  x
-  // xx
-  // x
-  0x02, // 30:0b 0000 0010
-  0x64, // 31:0b 0110 0100
-
-  // green 2+2 shifted block (inverse to red)
-  //  xx
-  // xx
-  0x06, // 32:0b 0000 0110
-  0xC0, // 33:0b 1100 0000
-
-  // x
-  // xx
-  //  x
-  0x04, // 34:0b 0000 0100
-  0x62, // 35:0b 0110 0010
-
-  //  xx
-  // xx
-  0x06, // 36:0b 0000 0110
-  0xC0, // 37:0b 1100 0000
-
-  // x
-  // xx
-  //  x
-  0x04, // 38:0b 0000 0100
-  0x62, // 39:0b 0110 0010
-
-  // blue 3+1 L-shaped block
-  // x.
-  // xxx
-  0x08, // 40:0b 0000 0000
-  0xE0, // 41:0b 1000 1110
-
-  // xx
-  // x.
-  // x
-  0xC8, // 42:0b 0000 1100
-  0x80, // 43:0b 1000 1000
-
-  // xxx
-  //  .x
-  0xE2, // 44:0b 0000 1110
-  0x00, // 45:0b 0010 0000
-
-  //   x
-  //  .x
-  //  xx
-  0x22, // 46:0b 0000 0010
-  0x60, // 47:0b 0010 0110
-
-  // orange 1+3 L-shaped block
-  //  .x
-  // xxx
-  0x02, // 48:0b 0000 0000
-  0xE0, // 49:0b 0010 1110
-
-  // x
-  // x.
-  // xx
-  0x88, // 50:0b 0000 1000
-  0xC0, // 51:0b 1000 1100
-
-  // xxx
-  // x.
-  0xE8, // 52:0b 0000 1110
-  0x00, // 53:0b 1000 0000
-
-  //  xx
-  //  .x
-  //   x
-  0x62, // 54:0b 0000 0110
-  0x20, // 55:0b 0010 0010
-};
 
+#if USE_HEADLESS
+static int64_t clock_virtual_ns; // --bench: the clock of the script, if set
+#endif
 
 /**
- * utility function to calculate (1 << nbits)
+ * monotonic clock in nanoseconds, it does not jump with NTP or
+ * wall-clock changes. Also the timebase for measurements.
  */
-unsigned char power_of_two( unsigned char nbits ) {
-  unsigned char mask;
-  
-  mask = (1 << nbits);
-  return mask;	
+int64_t time_ns()
+{
+  struct timespec time_now;
+#if USE_HEADLESS
+  if (clock_virtual_ns) return clock_virtual_ns;
+#endif
+  clock_gettime(CLOCK_MONOTONIC, &time_now); // reads time
+  return (int64_t) time_now.tv_sec*1000000000 + time_now.tv_nsec;
 }
 
 
 /**
- * fill the current_block0..3 variables with the bit pattern of the
- * selected block type (0,1..7).
- * 
- * Implementation note: the first version of the code used an array
- * current_block[4], which made for clean C sources but very clumsy
- * assembly code after compiling. Switching to four separate variables
- * with two utility functions reduced the code size and made the program
- * fit into the 16F627...
- */
-void create_rotated_block( unsigned char index, unsigned char rotation ) {
-  unsigned char tmp;
-  unsigned char i;
-  
-  i = (index<<3) + ((rotation&3)<<1);
-
-  tmp = rotated_block_pattern[i];
-  current_block0 = (tmp & 0xf0) >> 4;
-  current_block1 = (tmp & 0x0f);
-
-  tmp = rotated_block_pattern[i+1];
-  current_block2 = (tmp & 0xf0) >> 4;
-  current_block3 = (tmp & 0x0f);
+ * append the decimal number v to p, return the end.
+ */
+char *text_num( char *p, unsigned long v ) {
+  char digits[20];
+  int n;
+
+  n = 0;
+  do digits[n++] = '0' + v % 10; while( (v /= 10) > 0 );
+  while( n > 0 ) *p++ = digits[--n];
+  return p;
 }
 
-// exchange 2 random indices
-void shuffle_inactive_pool()
-{
-  unsigned char x, y, i, t;
-  i = active_pool ^ 1; // inactive pool
-  /* loop to prevent same piece appearing twice when switching pools */
-  do
-  {
-    do { x = rand() & 7; } while(x == 7);
-    do { y = rand() & 7; } while(y == 7 || y == x);
-    if (y == 0) { y = x; x = 0; } /* if y=0 swap x and y */
-  } while(x == 0 && shuffled_pool[active_pool][6] == shuffled_pool[i][y]);
-  /* x=0..6 y=0..6 */
-  /* exchange using temprary var */
-  t = shuffled_pool[i][x];
-  shuffled_pool[i][x] = shuffled_pool[i][y];
-  shuffled_pool[i][y] = t;
+
+char *text_str( char *p, const char *str ) {
+  while( *str ) *p++ = *str++;
+  return p;
 }
 
 
+#if TINY
 /**
- * create fair-random new block
- * from the active shuffled pool
+ * the few messages (-h) without stdio, one line with write().
  */
-void create_random_block( void ) {
-  unsigned char x;
-  shuffle_inactive_pool();
-  x = shuffled_pool[active_pool][pool_index];
-  if(++pool_index == 7)
-  {
-    pool_index = 0;
-    active_pool ^= 1;
-  }
-  create_rotated_block(x,0);
-  current_index = x;
-  current_rotation = 0;
+int text_line( const char *str ) {
+  if (write(1, str, strlen(str)) < 0 || write(1, "\n", 1) < 0)
+    return -1;
+  return 0;
 }
+#define puts(str) text_line(str)
+#endif
 
 
-void rotate_block( char r ) {
-  current_rotation = (current_rotation+r)&3;
-  create_rotated_block(current_index, current_rotation);
-}
+#if USE_STATS
+/*
+ * statistics (-t): the bytes sent by category, syscalls, fit tests,
+ * and how long it takes from reading a key to sending the frame that
+ * shows it, as a histogram. The bytes are classified as they pass
+ * vt100_putc(), by the escape sequence they belong to.
+ */
+#define STAT_GOTO    0 // cursor moves: CUP, CUU.., VT52 ESC Y, CR, LF, BS
+#define STAT_SGR     1 // colors
+#define STAT_GLYPHS  2 // characters drawn, REP and ECH
+#define STAT_SCROLL  3 // scroll region and reverse index
+#define STAT_OTHER   4 // erase, modes, bell, telnet
+#define STAT_CATS    5
+#define STAT_HIST    24 // latency buckets, k: < 2^k us
+
+struct stats {
+  unsigned long bytes[STAT_CATS];
+  unsigned long writes, reads, ioctls, polls;
+  unsigned long frames;
+  unsigned long fit_tests;            // of sessions that are gone
+  unsigned long latency[STAT_HIST];
+  int64_t start_ns;
+};
+
+static struct stats stats;
+static unsigned char STATS_on;
+#define STAT_COUNT(field) (stats.field++) // cheap enough to count always
+static volatile sig_atomic_t stats_due; // SIGUSR1
+
+// escape sequence being classified: state and bytes so far
+static unsigned char stat_esc, stat_len;
 
 
 /**
- * helper function to access one nibble (row) of the current block.
+ * count byte ch in its category; the bytes of an escape sequence are
+ * counted when its final character tells what it is.
  */
-unsigned char getBlockNibble( unsigned char i ) {
-  unsigned char tmp;
-  switch( i ) {
-       case 0: tmp = current_block0; break;
-       case 1: tmp = current_block1; break;
-       case 2: tmp = current_block2; break;
-       case 3: tmp = current_block3; break;
+void stat_byte( unsigned char ch ) {
+  unsigned char cat;
+
+  stat_len++;
+  switch( stat_esc ) {
+    case 0: // not in a sequence
+      stat_len = 1;
+      if (ch == 27) { stat_esc = 1; return; }
+      if (ch == '\r' || ch == '\n' || ch == '\b') cat = STAT_GOTO;
+      else if (ch >= ' ' && ch < 127) cat = STAT_GLYPHS;
+      else cat = STAT_OTHER;
+      break;
+    case 1: // after ESC
+      if (ch == '[') { stat_esc = 2; return; }
+      if (ch == 'Y') { stat_esc = 3; return; } // VT52 row col follow
+      if (ch == 'M') cat = STAT_SCROLL;
+      else if (ch == 'H' || (ch >= 'A' && ch <= 'D')) cat = STAT_GOTO; // VT52
+      else cat = STAT_OTHER;
+      break;
+    case 2: // CSI parameters up to the final character
+      if (ch < 0x40 || ch > 0x7e) return;
+      if (ch == 'm') cat = STAT_SGR;
+      else if (ch == 'r') cat = STAT_SCROLL;
+      else if (ch == 'b' || ch == 'X') cat = STAT_GLYPHS;
+      else if (ch == 'H' || ch == 'f' || ch == 'G' || (ch >= 'A' && ch <= 'D')) cat = STAT_GOTO;
+      else cat = STAT_OTHER;
+      break;
+    case 3: // VT52 row
+      stat_esc = 4;
+      return;
+    default: // VT52 column
+      cat = STAT_GOTO;
+      break;
   }
-  return tmp;
+  stats.bytes[cat] += stat_len;
+  stat_esc = 0;
 }
 
 
 /**
- * check whether the current block has a pixel at position(row,col)
+ * input was read now: the next frame sent shows it.
  */
-bit getBlockPixel( unsigned char row, unsigned char col ) {
-  //return (current_block[row] & power_of_two(col) != 0;
-  unsigned char tmp;
-  tmp = getBlockNibble( row );
-  return (tmp & power_of_two(col)) != 0;
+void stat_input( void ) {
+  if (STATS_on && ses->input_ns == 0)
+    ses->input_ns = time_ns();
 }
 
 
 /**
- * accessor function for the gaming board position at (row,col).
- * Use val=1 for occupied and val=0 for empty places.
+ * a frame was sent, count the time since its input.
  */
-void setPixel( unsigned char row, unsigned char col, unsigned char val ) {
-  unsigned char index;
-  unsigned char mask;
-  
-  index  = (row >> 3)*10 + col;
-  mask   = power_of_two(row & 0x7);
-  
-  if (val == 0)   board[index] &= ((unsigned char) ~mask);
-  else            board[index] |= mask;
+void stat_frame( void ) {
+  unsigned long us;
+  unsigned char k;
+
+  if (!STATS_on) return;
+  stats.frames++;
+  if (ses->input_ns == 0) return;
+  us = (time_ns() - ses->input_ns) / 1000;
+  for(k = 0; us > 0 && k < STAT_HIST-1; k++)
+    us >>= 1;
+  stats.latency[k]++;
+  ses->input_ns = 0;
 }
 
 
-/**
- * check whether the gaming board position at (row,col) is occupied.
- */
-bit occupied( unsigned char row, unsigned char col ) {
-  unsigned char index;
-  unsigned char mask;
+void stat_signal( int sig ) {
+  (void) sig;
+  stats_due = 1;
+}
+
 
-  index = (row >> 3)*10 + col;
-  mask  = power_of_two(row & 0x7);
+#if USE_HEADLESS
+// render benchmark (--bench): the frames end here instead of a terminal
+static unsigned long bench_digest;
 
-  return (board[index] & mask) != 0;
+void bench_take( const unsigned char *p, unsigned int n ) {
+  while( n-- > 0 )
+    bench_digest = (bench_digest ^ *p++) * 16777619UL & 0xffffffffUL; // FNV-1a
 }
+#endif
+#else
+#define STAT_COUNT(field) ((void) 0)
+#endif /* USE_STATS */
 
 
-/**
- * clear the whole gaming board.
- */
-void clear_board( void ) {
-  unsigned char r, c;
-  for( r=0; r < ROWS; r++ ) {
-  	for( c=0; c < COLS; c++ ) {
-  	  setPixel( r, c, 0 );	
-  	}
-  }	
-}
+#if USE_SERVER
+static int epoll_fd;
+static struct session *sessions; // all connections
 
 
 /**
- * create a randomly populated gaming board.  
+ * wait for the socket of session s to take output when some is pending.
  */
-/* Uncommented to save program memory space.
-void random_board( void ) {
-  unsigned char r, c, val;
-  
-  for( r=0; r < ROWS; r++ ) {
-  	for( c=0; c < COLS; c++ ) {
-  	  val = rand() & 0x01;
-  	  setPixel( r, c, val );	
-  	}
-  }	
+void session_want_out( struct session *s ) {
+  struct epoll_event ev;
+  unsigned char out;
+
+  out = s->outbuf_len > s->outbuf_start;
+  if (out == s->epoll_out) return;
+  s->epoll_out = out;
+  ev.events = out ? EPOLLIN | EPOLLOUT : EPOLLIN;
+  ev.data.ptr = s;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->fd, &ev);
 }
-*/
 
 
 /**
- * check whether the current block fits at the position given by
- * (current_row, current_col).
- * Returns 1 if the block fits, and 0 if not.
+ * send the part of the frame buffer the watchers don't have yet
+ * straight from the player's buffer, one write() per watcher. Only
+ * what a socket doesn't take is copied to the watcher's own buffer,
+ * and a watcher that still has output pending skips frames until
+ * it gets a snapshot, so it never holds up the player.
  */
-bit test_if_block_fits( void ) {
-  unsigned char i, j;
-  signed char ccj;
-  for( i=0; i < 4; i++ ) {
-  	for( j=0; j < 4; j++ ) {
-  	  if (getBlockPixel(i,j)) {
-  	  	ccj = current_col + j;
-  	  	if (ccj < 0) return 0; // too far left
-  	  	if (ccj >= 10)  return 0; // too far right
-  	  	if (current_row+i >= ROWS) return 0; // too low
-  	  	
-  	  	if (occupied(current_row+i, ccj)) return 0;
-  	  }	
-  	}
+void watchers_send( void ) {
+  struct session *w;
+  unsigned int n;
+  int r;
+
+  n = ses->outbuf_len - ses->bcast;
+  for( w = ses->watchers; w; w = w->watch_next ) {
+    if (w->watch_behind) continue;
+    if (w->outbuf_len > w->outbuf_start) {
+      w->watch_behind = 1;
+      continue;
+    }
+    do { r = write(w->fd, ses->outbuf+ses->bcast, n); STAT_COUNT(writes); }
+    while( r < 0 && errno == EINTR );
+    if (r < 0 && errno != EAGAIN) continue; // gone, the read tells
+    if (r < 0) r = 0;
+    if ((unsigned int) r < n) {
+      memcpy(w->outbuf, ses->outbuf+ses->bcast+r, n-r);
+      w->outbuf_start = 0;
+      w->outbuf_len = n-r;
+      session_want_out(w);
+    }
   }
-  
-  return 1; // block fits
+  ses->bcast = ses->outbuf_len;
 }
+#endif /* USE_SERVER */
 
 
 /**
- * copy the bits from the current block at its current position 
- * to the gaming board. This means to fix the current 'foreground'
- * block into the static 'background' gaming-board pattern.
+ * send the collected frame buffer to the terminal with one write().
+ * Called once per main-loop iteration, and early from vt100_putc()
+ * when the buffer reaches OUTBUF_limit. Returns without waiting when
+ * a non-blocking terminal is busy, the rest stays pending.
  */
-void copy_block_to_gameboard( void ) {
-  unsigned char i, j;
-  unsigned char cri, ccj;
+void vt100_flush( void ) {
+  int r;
 
-  for( i=0; i < 4; i++ ) {
-  	cri = current_row + i;
-  	for( j=0; j < 4; j++ ) {
-  	  ccj = current_col + j;
-  	  if (getBlockPixel(i,j)) {
-  	  	setPixel( cri, ccj, 0x01 );
-  	  }	
-  	}
+#if USE_HEADLESS && USE_STATS
+  if (ses->fd < 0) { // --bench
+    bench_take(ses->outbuf+ses->outbuf_start, ses->outbuf_len-ses->outbuf_start);
+    ses->outbuf_start = ses->outbuf_len = 0;
+    return;
+  }
+#endif
+#if USE_SERVER
+  if (ses->bcast < ses->outbuf_len)
+    watchers_send();
+#endif
+  while( ses->outbuf_start < ses->outbuf_len ) {
+    r = write(ses->fd, ses->outbuf+ses->outbuf_start, ses->outbuf_len-ses->outbuf_start);
+    STAT_COUNT(writes);
+    if (r > 0 && r < ses->outbuf_len-ses->outbuf_start) ses->link_queued = 1;
+    if (r > 0) ses->outbuf_start += r;
+    else if (r < 0 && errno == EINTR) continue;
+    else if (r < 0 && errno == EAGAIN) { // terminal busy
+      ses->link_queued = 1;
+      return;
+    }
+    else break; // terminal gone
   }
+  ses->outbuf_start = ses->outbuf_len = 0;
+#if USE_SERVER
+  ses->bcast = 0;
+#endif
 }
 
 
 /**
- * check whether the specified game-board row (0=top,23=bottom)
- * is complete (all bits set) or not.
+ * wait until the terminal has taken all pending output.
+ * The server does not wait for one client: one that stopped
+ * reading is dropped.
  */
-bit is_complete_row( unsigned char r ) {
-  unsigned char c;
-  
-  for( c=0; c < COLS; c++ ) {
-    if (!occupied(r,c))	return 0;
-  }	
-  
-  return 1;
+void vt100_flush_wait( void ) {
+  struct pollfd fds;
+
+  for( vt100_flush(); ses->outbuf_len > 0; vt100_flush() ) {
+    if (ses != &console) {
+      ses->state |= QUIT;
+      ses->outbuf_start = ses->outbuf_len = 0;
+#if USE_SERVER
+      ses->bcast = 0;
+#endif
+      return;
+    }
+    fds.fd = ses->fd;
+    fds.events = POLLOUT;
+    poll(&fds, 1, -1);
+    STAT_COUNT(polls);
+  }
 }
 
 
 /**
- * remove one (presumed complete) row from the game-board,
- * so that all rows above the specified row drop one level.
+ * number of bytes sent but not yet on the screen: pending in outbuf
+ * plus queued in the tty driver (TIOCOUTQ), so that the renderer can
+ * notice a terminal that does not keep up.
+ * The driver is only asked after a write came up short, until its
+ * queue is empty again (or always with -b): a terminal that takes
+ * every frame at once costs no extra system call per move.
  */
-void remove_row( unsigned char row ) {
-  unsigned char r, c, tmp;
-  
-  for( c=0; c < COLS; c++ ) {
-  	for( r=row; r>0; r-- ) {
-  	  tmp = occupied( r-1, c );
-  	  setPixel( r, c, tmp );
-  	}
-
-    // finally, clear topmost pixel
-    setPixel( 0, c, 0 );  	
+unsigned int vt100_backlog( void ) {
+  int queued;
+
+  queued = 0;
+#ifdef TIOCOUTQ // not in the headers of every compiler (<sys/ioctl.h>)
+  if (ses->link_queued || ses->link_fixed) {
+    STAT_COUNT(ioctls);
+    if (ioctl(ses->fd, TIOCOUTQ, &queued) < 0) queued = 0; // also sockets
+    ses->link_queued = queued > 0 || ses->outbuf_start > 0;
   }
+#endif
+  return ses->outbuf_len - ses->outbuf_start + queued;
 }
 
 
 /** 
- * transmit the given character via tx to the terminal.
- * We assume that we can immediately put the new data into the transmit
- * buffer register TXREG. Afterwards, we should wait until the TRMT
- * (TXSTA<1>) bit is 1 to indicate that TSR is empty again.
- * Unfortunately, this doesn't work reliably with the Hades 16F628
- * simulation model, so that we use an explicit wait loop instead.
- * You will have to update the wait loop limit when chaning the
- * RS232 communication parameters (baudrate) and PIC input clock
- * frequency.
+ * transmit the given character to the terminal.
+ * The PIC version waited for the transmitter here after each character;
+ * on linux each fflush() was one write() syscall per character, so now
+ * characters are just collected in the frame buffer and sent together
+ * by vt100_flush().
  */
 void vt100_putc( unsigned char ch ) {
-  putchar(ch);
-  fflush(stdout);
+  if (ses->outbuf_len == OUTBUF_SIZE) {
+    if (ses->outbuf_start > 0) { // make room by dropping what was sent
+      memmove( ses->outbuf, ses->outbuf+ses->outbuf_start, ses->outbuf_len-ses->outbuf_start );
+      ses->outbuf_len -= ses->outbuf_start;
+#if USE_SERVER
+      ses->bcast -= ses->outbuf_start; // always sent before the terminal
+#endif
+      ses->outbuf_start = 0;
+    }
+    else
+      vt100_flush_wait(); // full, we really have to wait
+  }
+  ses->outbuf[ses->outbuf_len++] = ch;
+  ses->link_total++;
+#if USE_STATS
+  if (STATS_on) stat_byte(ch);
+#endif
+  if (ses->outbuf_len-ses->outbuf_start >= OUTBUF_limit) vt100_flush();
 }
 
 
@@ -712,16 +819,17 @@ void vt100_exit_vt52_mode( void ) {
 }
 
 
+/**
+ * 'ESC [ m' resets blink and background to the default color,
+ * not sent if the terminal is already there.
+ */
 void vt100_default_color()
 {
-  vt100_putc( 27 );
-  vt100_putc( '[' );
-  vt100_putc( '4' );
-  vt100_putc( '9' );
-  vt100_putc( 'm' );
+  if (ses->sgr_color == COLOR_DEFAULT) return;
   vt100_putc( 27 );
   vt100_putc( '[' );
   vt100_putc( 'm' );
+  ses->sgr_color = COLOR_DEFAULT;
 }
 
 
@@ -738,7 +846,7 @@ void vt100_default_scroll_region()
  * We send the VT100/VT52 command 'ESC H'.
  */
 void vt100_cursor_home( void ) {
-  if(VT52_mode)
+  if(ses->VT52_mode)
   {
     vt100_putc( 27 );    // ESC
     vt100_putc( 'H' );
@@ -749,15 +857,27 @@ void vt100_cursor_home( void ) {
     vt100_putc( '[' );
     vt100_putc( 'H' );
   }
+  ses->cursor_row = 0;
+  ses->cursor_col = 0;
 }
 
 
 /** clear screen
+ * (in the default color, so the shadow screen is all empty cells)
  */
 void vt100_clear_screen(void)
 {
+  unsigned char r, c;
+  for(r = 0; r < SCREEN_ROWS; r++)
+    for(c = 0; c < SCREEN_CELLS; c++)
+    {
+      ses->shadow_ch[r][c] = CHAR_SPACE;
+      ses->shadow_color[r][c] = COLOR_DEFAULT;
+    }
+  ses->panel_valid = 0;
+
   vt100_cursor_home();
-  if(VT52_mode)
+  if(ses->VT52_mode)
   {
     vt100_putc(27);
     vt100_putc('J');  // clear to end of screen
@@ -810,15 +930,264 @@ void vt100_itoa( unsigned char val ) {
 }
 
 
+void vt100_puts( const char *str ) {
+  while( *str )
+    vt100_putc( *str++ );
+}
+
+
+/**
+ * number of decimal digits of val
+ */
+unsigned char vt100_digits( unsigned char val ) {
+  if (val >= 100) return 3;
+  if (val >= 10)  return 2;
+  return 1;
+}
+
+
+/*
+ * escape sequences formatted once by vt100_init_tables(), so that the
+ * most frequent ones are appended with one memcpy(): the absolute
+ * cursor address of every position in the board area (VT100 and VT52)
+ * and the SGR of every background color, with and without the reset
+ * of the blink state before it. Byte 0 is the length.
+ */
+#define SEQ_MAX     10
+#define GOTO_COLS   (SCREEN_CELLS*2) // DRAW_multi 2
+#define SGR_COLORS  108
+
+#if !TINY // the tiny build formats each one as it is sent
+static unsigned char goto_seq[2][SCREEN_ROWS][GOTO_COLS][SEQ_MAX]; // [VT52_mode]
+static unsigned char sgr_seq[2][SGR_COLORS][SEQ_MAX];              // [blink changes]
+
+
+void vt100_init_tables( void ) {
+  unsigned char r, c, color;
+  char *p;
+
+  for(r = 0; r < SCREEN_ROWS; r++)
+    for(c = 0; c < GOTO_COLS; c++) {
+      p = text_str((char *) goto_seq[0][r][c]+1, "\033[");
+      p = text_num(p, r+1);
+      *p++ = ';';
+      p = text_num(p, c+1);
+      *p++ = 'H';
+      goto_seq[0][r][c][0] = p - (char *) goto_seq[0][r][c] - 1;
+
+      p = text_str((char *) goto_seq[1][r][c]+1, "\033Y");
+      *p++ = r+32;
+      *p++ = c+32;
+      goto_seq[1][r][c][0] = 4;
+    }
+
+  for(color = 0; color < SGR_COLORS; color++) {
+    p = text_str((char *) sgr_seq[0][color]+1, "\033[");
+    p = text_num(p, color);
+    *p++ = 'm';
+    sgr_seq[0][color][0] = p - (char *) sgr_seq[0][color] - 1;
+
+    p = text_str((char *) sgr_seq[1][color]+1, color >= 100 ? "\033[5;" : "\033[0;");
+    p = text_num(p, color);
+    *p++ = 'm';
+    sgr_seq[1][color][0] = p - (char *) sgr_seq[1][color] - 1;
+  }
+}
+
+
+/**
+ * append a sequence from the tables, the same as vt100_putc() for each
+ * of its bytes.
+ */
+void vt100_put_seq( const unsigned char *seq ) {
+  unsigned char n, i;
+
+  n = seq[0];
+  if (ses->outbuf_len + n > OUTBUF_SIZE) { // let vt100_putc() make room
+    for(i = 1; i <= n; i++)
+      vt100_putc( seq[i] );
+    return;
+  }
+  memcpy( ses->outbuf+ses->outbuf_len, seq+1, n );
+  ses->outbuf_len += n;
+  ses->link_total += n;
+#if USE_STATS
+  if (STATS_on)
+    for(i = 1; i <= n; i++)
+      stat_byte(seq[i]);
+#endif
+  if (ses->outbuf_len-ses->outbuf_start >= OUTBUF_limit) vt100_flush();
+}
+#endif /* !TINY */
+
+
+/**
+ * bytes needed to move the cursor n positions with vt100_move()
+ */
+unsigned char vt100_move_cost( unsigned char n ) {
+  if (n == 0)    return 0;
+  if (ses->VT52_mode) return 2*n;            // ESC dir per position
+  if (n == 1)    return 3;              // ESC [ dir
+  return 3 + vt100_digits(n);           // ESC [ n dir
+}
+
+
+/**
+ * move the cursor n positions up 'A', down 'B', right 'C' or left 'D'.
+ * VT52 has the same direction letters, but only single steps.
+ */
+void vt100_move( unsigned char n, unsigned char dir ) {
+  if (n == 0) return;
+  if(ses->VT52_mode)
+  {
+    for( ; n > 0; n-- )
+    {
+      vt100_putc( 27 );
+      vt100_putc( dir );
+    }
+  }
+  else
+  {
+    vt100_putc( 27 );
+    vt100_putc( '[' );
+    if (n > 1) vt100_itoa(n);
+    vt100_putc( dir );
+  }
+}
+
+
+/**
+ * check whether the cursor can move right from col 'from' to 'to' by
+ * simply printing again what the shadow screen says is already there,
+ * in the color that is currently set.
+ */
+bit vt100_can_overprint( unsigned char row, unsigned char from, unsigned char to ) {
+  unsigned char col;
+
+  if (row >= SCREEN_ROWS || (to-1)/ses->DRAW_multi >= SCREEN_CELLS) return 0;
+  for( col=from; col < to; col++ )
+  {
+    if (ses->shadow_ch[row][col/ses->DRAW_multi] == 0) return 0; // never drawn
+    if (ses->VT52_mode == 0 && ses->VT100_color && ses->shadow_color[row][col/ses->DRAW_multi] != ses->sgr_color) return 0;
+  }
+  return 1;
+}
+
+
+#define MOVE_NONE      0
+#define MOVE_CR        1
+#define MOVE_CR_RIGHT  2
+#define MOVE_BS        3
+#define MOVE_LEFT      4
+#define MOVE_RIGHT     5
+#define MOVE_OVERPRINT 6
+#define MOVE_ABSOLUTE  7
+
+/**
+ * find the cheapest way to move the cursor within row from col 'from'
+ * to col 'to', returns the cost in bytes and the method in *how.
+ */
+unsigned char vt100_hmove_cost( unsigned char row, unsigned char from, unsigned char to, unsigned char *how ) {
+  unsigned char best, n;
+
+  if (to == from) { *how = MOVE_NONE; return 0; }
+
+  if (to < from)
+  {
+    n = from - to;
+    if (to == 0) { *how = MOVE_CR; best = 1; }
+    else         { *how = MOVE_CR_RIGHT; best = 1 + vt100_move_cost(to); }
+    if (n < best) { *how = MOVE_BS; best = n; }
+    if (vt100_move_cost(n) < best) { *how = MOVE_LEFT; best = vt100_move_cost(n); }
+  }
+  else
+  {
+    n = to - from;
+    *how = MOVE_RIGHT; best = vt100_move_cost(n);
+    if (n < best && vt100_can_overprint(row, from, to)) { *how = MOVE_OVERPRINT; best = n; }
+  }
+  return best;
+}
+
+
+void vt100_hmove( unsigned char row, unsigned char from, unsigned char to, unsigned char how ) {
+  unsigned char col;
+
+  switch( how )
+  {
+    case MOVE_CR:
+      vt100_putc( 13 );
+      break;
+    case MOVE_CR_RIGHT:
+      vt100_putc( 13 );
+      vt100_move( to, 'C' );
+      break;
+    case MOVE_BS:
+      for( col=from; col > to; col-- )
+        vt100_putc( 8 );
+      break;
+    case MOVE_LEFT:
+      vt100_move( from-to, 'D' );
+      break;
+    case MOVE_RIGHT:
+      vt100_move( to-from, 'C' );
+      break;
+    case MOVE_OVERPRINT:
+      for( col=from; col < to; col++ )
+        vt100_putc( ses->shadow_ch[row][col/ses->DRAW_multi] );
+      break;
+  }
+}
+
+
 /**
  * move the VT100 cursor to the given position.
  * This is done by sending 'ESC Y l c'
  * NOTE: VT52 expects an offset of 32 for the l and c values.
  * row,col -> y,x
+ * When we know where the cursor is, a shorter relative move (CR, BS,
+ * cursor up/down/left/right, overprinting) is used if there is one,
+ * and nothing is sent when the cursor is already in place.
  */
+unsigned char vt100_goto_cost( unsigned char row, unsigned char col, unsigned char *how )
+{
+  unsigned char cost, absolute, n;
+
+#if !TINY
+  if (row < SCREEN_ROWS && col < GOTO_COLS)
+    absolute = goto_seq[ses->VT52_mode][row][col][0];
+  else
+#endif
+    absolute = ses->VT52_mode ? 4 : 4 + vt100_digits(row+1) + vt100_digits(col+1);
+  *how = MOVE_ABSOLUTE;
+  if (ses->cursor_row == CURSOR_UNKNOWN) return absolute;
+
+  n = row > ses->cursor_row ? row - ses->cursor_row : ses->cursor_row - row;
+  cost = vt100_move_cost(n) + vt100_hmove_cost(row, ses->cursor_col, col, how);
+  if (cost < absolute) return cost;
+  *how = MOVE_ABSOLUTE;
+  return absolute;
+}
+
+
 void vt100_goto( unsigned char row, unsigned char col )
 {
-  if(VT52_mode)
+  unsigned char how;
+
+  if (ses->cursor_row == row && ses->cursor_col == col) return;
+
+  vt100_goto_cost(row, col, &how);
+  if (how != MOVE_ABSOLUTE)
+  {
+    vt100_move( row > ses->cursor_row ? row - ses->cursor_row : ses->cursor_row - row,
+                row > ses->cursor_row ? 'B' : 'A' );
+    vt100_hmove( row, ses->cursor_col, col, how );
+  }
+#if !TINY
+  else if (row < SCREEN_ROWS && col < GOTO_COLS)
+    vt100_put_seq( goto_seq[ses->VT52_mode][row][col] );
+#endif
+  else if(ses->VT52_mode)
   {
     vt100_putc( 27 );   // ESC
     vt100_putc( 'Y' );  // ESC-Y
@@ -834,50 +1203,135 @@ void vt100_goto( unsigned char row, unsigned char col )
     vt100_itoa(col+1);
     vt100_putc( 'H' );  // set cursor
   }
+  ses->cursor_row = row;
+  ses->cursor_col = col;
+}
+
+
+/**
+ * park the cursor in the top left corner at the end of a frame.
+ * HACK:
+ * extra goto because neither xterm/seycon nor Winxp hyperterm
+ * understand the VT52 "cursor off" command, and the blinking
+ * cursor at the end of a block is really annoying...
+ * a "real" VT100/VT52 does work fine without this.
+ */
+void vt100_park_cursor( void )
+{
+  vt100_goto( 0, 0 );
 }
 
 
+/**
+ * set the background color with one SGR sequence, only when it
+ * differs from what was sent last.
+ */
 void vt100_bgcolor(unsigned char color)
 {
+  unsigned char blink;
+
+  if (color == ses->sgr_color) return;
+  if (color == COLOR_DEFAULT)
+  {
+    vt100_default_color();
+    return;
+  }
+
   // linux FB workaround:
   // bright bg colors can be obtained
   // by enablink blink mode
   // VT100 standard colors >= 100
   // look the same as non-bright colors
   // if blink is not enabled.
-  vt100_putc( 27 );
-  vt100_putc( '[' );
-  if(color >= 100)
-    vt100_putc( '5' );
-  vt100_putc( 'm' );
-
+  blink = ses->sgr_color != SGR_UNKNOWN && ses->sgr_color >= 100;
+#if !TINY
+  if (color < SGR_COLORS)
+  {
+    vt100_put_seq( sgr_seq[color >= 100 ? !blink : blink || ses->sgr_color == SGR_UNKNOWN][color] );
+    ses->sgr_color = color;
+    return;
+  }
+#endif
   vt100_putc(27);    // ESC
   vt100_putc('[');
   if(color >= 100)
   {
+    if(!blink)
+    {
+      vt100_putc('5');
+      vt100_putc(';');
+    }
     vt100_putc('1');
-    color -= 100;
+    vt100_xtoa(color-100);
+  }
+  else
+  {
+    if(blink || ses->sgr_color == SGR_UNKNOWN)
+    {
+      vt100_putc('0'); // reset blink
+      vt100_putc(';');
+    }
+    vt100_xtoa(color);
   }
-  vt100_xtoa(color);
   vt100_putc('m');  // set color
+  ses->sgr_color = color;
 }
 
 
-void vt100_scroll_region_down(unsigned char b)
+/**
+ * the terminal has scrolled rows 0..b down by one (see below) and
+ * inserted an empty top row, do the same with the shadow screen.
+ */
+void shadow_scroll_down(unsigned char b)
 {
-  vt100_cursor_home(); // to top of region
-
-  vt100_putc(27);    // ESC
-  vt100_putc('[');
+  unsigned char r, c;
+  if(b >= SCREEN_ROWS) b = SCREEN_ROWS-1;
+  for(r = b; r > 0; r--)
+    for(c = 0; c < SCREEN_CELLS; c++)
+    {
+      ses->shadow_ch[r][c] = ses->shadow_ch[r-1][c];
+      ses->shadow_color[r][c] = ses->shadow_color[r-1][c];
+    }
+  for(c = 0; c < SCREEN_CELLS; c++)
+  {
+    ses->shadow_ch[0][c] = CHAR_SPACE;
+    ses->shadow_color[0][c] = COLOR_DEFAULT;
+  }
+}
+
+
+/**
+ * scroll rows 0..b down by n rows: set the scroll region once,
+ * then one reverse index per row (VT100 has no scroll down n).
+ * When the region reaches the panel row, the panel scrolls out and
+ * display_score() has to paint it again, labels and all.
+ */
+void vt100_scroll_region_down(unsigned char b, unsigned char n)
+{
+  unsigned char i;
+
+  for(i = 0; i < n; i++)
+    shadow_scroll_down(b);
+  if (b >= PANEL_ROW)
+    ses->panel_valid = 0;
+  vt100_goto(0, 0); // to top of region
+
+  vt100_putc(27);    // ESC
+  vt100_putc('[');
   vt100_putc('1');
   vt100_putc( ';' );
   vt100_itoa(b+1);
   vt100_putc( 'r' );  // set region
 
-  vt100_putc(27);
-  vt100_putc('M');   // at top of region, scroll down
+  for(i = 0; i < n; i++)
+  {
+    vt100_putc(27);
+    vt100_putc('M');   // at top of region, scroll down
+  }
 
   vt100_default_scroll_region();
+  ses->cursor_row = 0; // setting the region homes the cursor
+  ses->cursor_col = 0;
 }
 
 
@@ -889,42 +1343,63 @@ void vt100_erase_to_end_of_line(void)
 }
 
 
-void block_color(unsigned char paintMode)
+/**
+ * background color block b is painted with,
+ * COLOR_DEFAULT for erasing and on terminals without color.
+ */
+unsigned char paint_color(const struct tetris_block *b, unsigned char paintMode)
+{
+  if(ses->VT52_mode == 0)
+    if(ses->VT100_color)
+      if(paintMode == PAINT_ACTIVE || paintMode == PAINT_FIXED)
+        return index2color[b->index];
+  return COLOR_DEFAULT;
+}
+
+
+void block_color(const struct tetris_block *b, unsigned char paintMode)
 {
-  unsigned char bgcolor;
-  if(VT52_mode == 0)
+  if(ses->VT52_mode == 0)
   {
-    if(VT100_color)
-    {
-      bgcolor = 49; // default color (black)
-      bgcolor = paintMode == PAINT_ACTIVE || paintMode == PAINT_FIXED ? index2color[current_index] : 49;
-      vt100_bgcolor(bgcolor);
-    }
+    if(ses->VT100_color)
+      vt100_bgcolor(paint_color(b, paintMode));
   }
 }
 
 
 void vt_default_color()
 {
-  if(VT52_mode == 0)
-    if(VT100_color)
+  if(ses->VT52_mode == 0)
+    if(ses->VT100_color)
        vt100_default_color();
 }
 
-void reset_terminal_mode()
+/**
+ * leave the terminal in its default modes.
+ */
+void vt_reset()
 {
-  int r;
-  if(VT52_mode)
+  if(ses->VT52_mode)
     vt100_exit_vt52_mode();
   else
   {
     vt_default_color();
-    if(VT100_scroll)
+    if(ses->VT100_scroll)
     {
       vt100_default_scroll_region();
-      vt100_goto(23,0);
+      vt100_goto(ROWSD,0);
     }
   }
+}
+
+
+void reset_terminal_mode()
+{
+  int r;
+  ses = &console;
+  vt_reset();
+  vt100_flush_wait();
+  fcntl(1, F_SETFL, stdout_flags);
   r = ioctl(0, TCSETS, &orig_termios);
 }
 
@@ -949,78 +1424,189 @@ void terminal_initialize( void ) {
 
   r = ioctl(0, TCSETS, &current_termios);
 
+  stdout_flags = fcntl(1, F_GETFL);
+#if USE_POLL
+  // don't block in write(), isr() keeps reading keys while a slow
+  // terminal is busy and the rest of the frame waits in outbuf
+  fcntl(1, F_SETFL, stdout_flags | O_NONBLOCK);
+#endif
+
   atexit(reset_terminal_mode);
 }
 
 
 /**
- * display (or erase) the current block at its current position,
- * depending on whether the paintMode parameter is PAINT_ACTIVE,
- * PAINT_FIXED, or ERASE.
+ * send the pending run of equal characters collected by display_cell(),
+ * whichever is shortest: the characters, the first one and a REP for
+ * the others, or for spaces an ECH (which leaves the cursor at the start
+ * of the run, so the move to the next position row,col is counted too;
+ * use CURSOR_UNKNOWN when that is not known yet).
+ */
+void vt100_send_pending( unsigned char row, unsigned char col ) {
+  unsigned char n, ch, end, cost, rep, ech, how;
+
+  n = ses->pending_n;
+  ch = ses->pending_ch;
+  ses->pending_n = 0;
+  if (n == 0) return;
+
+  cost = n;
+  rep = 4 + (n-1 > 1 ? vt100_digits(n-1) : 0); // ch ESC [ n-1 b
+  if (rep < cost) cost = rep;
+
+  ech = 3 + (n > 1 ? vt100_digits(n) : 0);     // ESC [ n X
+  if (ch == CHAR_SPACE)
+  {
+    if (row != CURSOR_UNKNOWN)
+    {
+      cost += vt100_goto_cost(row, col, &how);
+      end = ses->cursor_col;
+      ses->cursor_col -= n; // ECH does not move the cursor
+      ech += vt100_goto_cost(row, col, &how);
+      ses->cursor_col = end;
+    }
+    if (ech < cost)
+    {
+      vt100_putc( 27 );
+      vt100_putc( '[' );
+      if (n > 1) vt100_itoa(n);
+      vt100_putc( 'X' );
+      ses->cursor_col -= n;
+      return;
+    }
+  }
+
+  if (rep < n)
+  {
+    vt100_putc( ch );
+    vt100_putc( 27 );
+    vt100_putc( '[' );
+    if (n-1 > 1) vt100_itoa(n-1);
+    vt100_putc( 'b' );
+  }
+  else
+    for( ; n > 0; n-- )
+      vt100_putc( ch );
+}
+
+
+/**
+ * draw one cell of the board area (DRAW_multi characters) in the
+ * given color, unless the shadow screen says it is already shown.
+ * Cursor moves are only sent where a run of drawn cells breaks.
+ */
+void display_cell( unsigned char row, unsigned char cell, unsigned char ch, unsigned char color ) {
+  unsigned char k, col;
+
+  if (ses->shadow_ch[row][cell] == ch && ses->shadow_color[row][cell] == color) return;
+
+  col = cell*ses->DRAW_multi;
+  if (ses->pending_n)
+    if (ses->cursor_row != row || ses->cursor_col != col || ses->pending_ch != ch
+        || color != ses->sgr_color)
+      vt100_send_pending( row, col );
+  if (ses->VT52_mode == 0 && ses->VT100_color)
+    vt100_bgcolor( color );
+
+  vt100_goto( row, col ); // nothing to send within a run
+  if (ses->VT100_rep)
+  {
+    ses->pending_ch = ch;
+    ses->pending_n += ses->DRAW_multi;
+  }
+  else
+    for(k = 0; k < ses->DRAW_multi; k++)
+      vt100_putc( ch );
+  ses->cursor_col += ses->DRAW_multi;
+
+  ses->shadow_ch[row][cell] = ch;
+  ses->shadow_color[row][cell] = color;
+}
+
+
+/**
+ * display block b (the current or the just locked block), PAINT_ACTIVE
+ * or PAINT_FIXED, and erase what is left of the block as it was shown
+ * before. Cells covered by both are not touched at all.
  * This method just paints the active pixels from the block,
  * but nothing else (no game board, no borders, no score).
- * To achieve the best performance, we use the VT52 cursor
- * positioning commands via vt100_goto() for each of the
- * (always four) visible pixels of the block.
  */
-void display_block( unsigned char paintMode ) {
-  unsigned char i, j, k, ch;
-  unsigned char rr, cc;
-  char draw;
+void display_block( const struct tetris_block *b, unsigned char paintMode ) {
+  unsigned char i, j;
+  unsigned char rr, draw, color;
+  signed char k;
+  const row_t *cur;
+  row_t bits, old[4];
+
+  cur = tetris_block_rows(b);
+
+  // erase the shown block, except where the new one goes
+  if (ses->shown_valid) {
+    for( i=0; i < 4; i++ ) {
+      bits = tetris_block_rows(&ses->shown)[i];
+      k = ses->shown.row + i - b->row;
+      if (k >= 0 && k < 4) bits &= ~cur[k];
+      old[i] = bits;
+    }
+    if (old[0] | old[1] | old[2] | old[3]) {
+      block_color(b, ERASE);
+      for( i=0; i < 4; i++ ) {
+        rr = ses->shown.row + i;
+        if (rr < ROW0 || rr >= ROWS) continue; // out of range
+        for( j=0; j < COLS; j++ )
+          if (old[i] & (1 << j))
+            display_cell( rr-ROW0, XOFFSET + j, CHAR_SPACE, COLOR_DEFAULT );
+      }
+      vt100_send_pending( CURSOR_UNKNOWN, 0 );
+    }
+  }
 
-  block_color(paintMode);
+  draw = paintMode == PAINT_FIXED ? CHAR_ACTIVE_FIXED(b) : CHAR_ACTIVE(b);
+  color = paint_color(b, paintMode);
+  block_color(b, paintMode);
   for( i=0; i < 4; i++ ) {
-    rr = current_row + i;
+    rr = b->row + i;
     if (rr < ROW0 || rr >= ROWS) continue; // out of range
-
-    for ( j=0; j < 4; j++ ) {
-      cc = XOFFSET + current_col + j;
-      if (cc >= XLIMIT) continue; // out of range
-      if (getBlockPixel(i,j)) {
-        vt100_goto( rr-ROW0, cc*DRAW_multi );
-        if     (paintMode == PAINT_ACTIVE) draw = CHAR_ACTIVE;
-        else if (paintMode == PAINT_FIXED) draw = CHAR_ACTIVE_FIXED;
-        else                               draw = CHAR_SPACE;
-        for(k = 0; k < DRAW_multi; k++)
-          vt100_putc(draw);
-      }
-    }
-  	
-    // HACK:
-    // extra goto because neither xterm/seycon nor Winxp hyperterm
-    // understand the VT52 "cursor off" command, and the blinking
-    // cursor at the end of a block is really annoying...
-    // a "real" VT100/VT52 does work fine without this.
-    vt100_cursor_home();
+    for( j=0; j < COLS; j++ )
+      if (cur[i] & (1 << j))
+        display_cell( rr-ROW0, XOFFSET + j, draw, color );
   }
+  vt100_send_pending( CURSOR_UNKNOWN, 0 );
+  // the cursor is parked by vt100_park_cursor() at the end of the frame
+
+  ses->shown_valid = 1;
+  ses->shown = *b;
+  ses->active_dirty = 0;
 } // display_block
 
 
 /** 
  * display the current game board position on the terminal.
- * This method redraws the whole gaming board including borders.
+ * This method updates the given number of top rows (including borders,
+ * and the floor when all rows are updated). The fixed blocks are drawn
+ * as display_block() drew them when they stuck, in their colors, from
+ * the type planes of the board.
+ * Only the cells that differ from the shadow screen are sent, so
+ * the cost is proportional to the change, not to the board size.
  * Use another call to display_block() to also draw the current block.
  */
 void display_board( unsigned char rows, unsigned char walls_only ) {
-  unsigned char r,c,k;
-  unsigned char ch;
+  unsigned char r,c;
+  struct tetris_block b;
 
   for( r=0; r < rows; r++ ) {
-    vt100_goto( r, (XOFFSET-1)*DRAW_multi );
-
-    for(k = 0; k < DRAW_multi; k++)
-      vt100_putc( CHAR_WALL );            // one row of the board: border, data, border
-
-    if(walls_only)
-      vt100_goto( r, (XOFFSET+COLS)*DRAW_multi );
-    else
+    // one row of the board: border, data, border
+    display_cell( r, XOFFSET-1, CHAR_WALL, COLOR_DEFAULT );
+    if(!walls_only)
       for( c=0; c < COLS; c++ ) {
-        ch = occupied(r+ROW0,c) ? CHAR_FIXED : CHAR_SPACE;
-        for(k = 0; k < DRAW_multi; k++)
-          vt100_putc( ch );
+        if (!tetris_occupied(&ses->game, r+ROW0, c)) {
+          display_cell( r, XOFFSET+c, CHAR_SPACE, COLOR_DEFAULT );
+          continue;
+        }
+        b.index = tetris_cell_index(&ses->game, r+ROW0, c);
+        display_cell( r, XOFFSET+c, CHAR_ACTIVE_FIXED(&b), paint_color(&b, PAINT_FIXED) );
       }
-    for(k = 0; k < DRAW_multi; k++)
-      vt100_putc( CHAR_WALL );
+    display_cell( r, XLIMIT, CHAR_WALL, COLOR_DEFAULT );
     
     // a real VT52 wants both linefeed (10) and carriage-return (13).
     // We don't want a linefeed after the last row, because the terminal
@@ -1033,199 +1619,351 @@ void display_board( unsigned char rows, unsigned char walls_only ) {
   if(r == ROWSD)
   {
     // print floor
-    vt100_goto( r, (XOFFSET-1)*DRAW_multi );
-    for(k = 0; k < DRAW_multi*(COLS+2); k++)
-      vt100_putc( CHAR_FLOOR );
+    for( c=XOFFSET-1; c <= XLIMIT; c++ )
+      display_cell( r, c, CHAR_FLOOR, COLOR_DEFAULT );
   }
+  vt100_send_pending( CURSOR_UNKNOWN, 0 );
 }
 
-void erase_score( void ) {
-  unsigned char i, j;
-  for(j = 20; j < 22; j++)
-  {
-    vt100_goto(j, 40);
-    vt100_erase_to_end_of_line();
+/**
+ * the digits the panel shows for the current level and score,
+ * as vt100_xtoa() prints them.
+ */
+void panel_digits( unsigned char *d ) {
+  unsigned char i, val;
+
+  for( i=0; i < PANEL_DIGITS; i += 2 ) {
+    val = i == 0 ? ses->game.level
+        : i == 2 ? ses->game.score/10000
+        : i == 4 ? ses->game.score%10000/100
+        :          ses->game.score%100;
+    d[i]   = vt100_hex( (val / 10) & 0x0f );
+    d[i+1] = vt100_hex( val % 10 );
   }
 }
 
+
 /**
  * display the current level and score values on the terminal.
+ * The labels are painted once after the screen was cleared (or the
+ * panel scrolled away), then only the run of digits that changed in
+ * each of the two numbers is rewritten.
  */
 void display_score( void ) {
+  unsigned char d[PANEL_DIGITS];
+  unsigned char i, lo, hi, end;
+
+  panel_digits( d );
   vt_default_color();
-  vt100_goto( 22, 30 );
-#if 1
-  vt100_putc( 'L' );
-  vt100_putc( 'e' );
-  vt100_putc( 'v' );
-  vt100_putc( 'e' );
-  vt100_putc( 'l' );
-  vt100_putc( ':' );
-  vt100_putc( ' ' );
-#endif
-  vt100_xtoa( level );
-
-#if 1
-  vt100_putc( ' ' );
-  vt100_putc( ' ' );
-  //vt100_goto( 23, 40 );
-  vt100_putc( 'S' );
-  vt100_putc( 'c' );
-  vt100_putc( 'o' );
-  vt100_putc( 'r' );
-  vt100_putc( 'e' );
-  vt100_putc( ':' );
-  vt100_putc( ' ' );
-#endif
-  vt100_xtoa( score/10000 );
-  vt100_xtoa( score%10000/100 );
-  vt100_xtoa( score%100 );
-  vt100_putc( '\n' );
+  if (!ses->panel_valid) {
+    vt100_goto( PANEL_ROW, PANEL_COL );
+    vt100_putc( 'L' );
+    vt100_putc( 'e' );
+    vt100_putc( 'v' );
+    vt100_putc( 'e' );
+    vt100_putc( 'l' );
+    vt100_putc( ':' );
+    vt100_putc( ' ' );
+    vt100_putc( d[0] );
+    vt100_putc( d[1] );
+
+    vt100_putc( ' ' );
+    vt100_putc( ' ' );
+    vt100_putc( 'S' );
+    vt100_putc( 'c' );
+    vt100_putc( 'o' );
+    vt100_putc( 'r' );
+    vt100_putc( 'e' );
+    vt100_putc( ':' );
+    vt100_putc( ' ' );
+    for( i=2; i < PANEL_DIGITS; i++ )
+      vt100_putc( d[i] );
+    ses->cursor_col = PANEL_DIGIT_COL(PANEL_DIGITS-1)+1;
+    memcpy( ses->panel, d, PANEL_DIGITS );
+    ses->panel_valid = 1;
+    return;
+  }
+
+  for( i=0; i < PANEL_DIGITS; i = end ) { // level, then score
+    end = i == 0 ? 2 : PANEL_DIGITS;
+    for( lo=i; lo < end && d[lo] == ses->panel[lo]; lo++ ) ;
+    if (lo == end) continue;
+    for( hi=end; d[hi-1] == ses->panel[hi-1]; hi-- ) ;
+    vt100_goto( PANEL_ROW, PANEL_DIGIT_COL(lo) );
+    for( ; lo < hi; lo++ ) {
+      vt100_putc( d[lo] );
+      ses->panel[lo] = d[lo];
+    }
+    ses->cursor_col = PANEL_DIGIT_COL(hi-1)+1;
+  }
 }
 
 
 /**
- * check for completed rows and remove them from the gaming board.
+ * show the rows removed by the last lock: scroll them away on a VT100,
+ * or update the changed cells of the board.
  */
-void check_remove_completed_rows( void ) {
-  unsigned char r, removed;
-
-  removed = 0;
-  for( r=0; r < ROWS; r++ ) {
-    if (is_complete_row(r)) {
-      removed++;
-      break;
-    }
-  }
+void display_rows( void ) {
+  unsigned char i, r, run;
 
-  if(VT52_mode == 0)
+  if(ses->VT52_mode == 0)
   {
     vt_default_color();
-    if(VT100_scroll)
-      if(removed)
-        erase_score();
-  }
-
-  removed = 0;
-  for( r=0; r < ROWS; r++ ) {
-    if (is_complete_row(r)) {
-      removed++;
-      remove_row( r );
-      score += SCORE_PER_ROW*(level+1);
-      if(VT52_mode == 0)
-        if(VT100_scroll)
-          vt100_scroll_region_down(r-ROW0);
-      if(++lines == 4)
-      {
-        lines = 0;
-        if(level < MAX_level)
+    if(ses->VT100_scroll)
+    {
+      run = 0; // consecutive completed rows, scrolled away together
+      for( i=0; i < ses->game.cleared_n; i++ ) {
+        r = ses->game.cleared[i];
+        run++;
+        if(i+1 == ses->game.cleared_n || ses->game.cleared[i+1] != r+1) // end of run
         {
-          level++;
-          step_ms = STEP_FASTER(step_ms); // 3/4 times game speedup
+          vt100_scroll_region_down(r-ROW0, run);
+          run = 0;
         }
       }
     }
   }
 
-  if(current_row < free_rows)
-    free_rows = current_row;
-  free_rows += removed;
-  
-  if (removed) {
-    vt100_beep();
-    block_color(ERASE);
-    if(VT52_mode == 0)
-    {
-      if(VT100_scroll)
-        // redraw scrolled out walls on top
-        display_board(removed,1);
-      else
-        display_board(ROWSD,0);
-    }
-    display_score();
+  vt100_beep();
+  if(ses->VT52_mode == 0 && ses->VT100_scroll)
+    // redraw scrolled out walls on top
+    display_board(ses->game.cleared_n,1);
+  else
+    // update the changed cells
+    display_board(ROWSD,0);
+}
+
+
+#if USE_LEADERS
+/*
+ * leaderboard (-L file): the best LEADERS games of all the processes
+ * and server sessions that map the same file, updated without locks.
+ * An entry is one 64-bit word, score << 40 | level << 32 | the time the
+ * game ended in seconds (0: free), so entries compare as numbers and a
+ * compare-and-swap replaces one. A game walks down the table: where it
+ * beats an entry it takes the slot and goes on with the entry it pushed
+ * out, so the table stays sorted and the last one drops off.
+ * Each writer counts itself in begun when it starts and in done when it
+ * is finished; a reader copies the table while both are equal and begun
+ * didn't change, a seqlock for any number of writers.
+ */
+#define LEADERS_MAGIC 0x31424c54 // "TLB1" in the file
+#define LEADERS       10
+#define LEADERS_TRIES 1000       // copies before taking a torn one (a writer died)
+#define LEADERS_ROW   1
+
+struct leaders {
+  uint32_t magic;
+  uint32_t begun, done;
+  uint32_t pad;
+  uint64_t entry[LEADERS];
+};
+
+static struct leaders *leaders; // the mapped file, NULL without -L
+
+
+/**
+ * map the leaderboard file, create it when it doesn't exist.
+ */
+bit leaders_open( const char *file ) {
+  struct stat st;
+  void *map;
+  uint32_t magic;
+  int fd;
+
+  fd = open(file, O_RDWR | O_CREAT, 0644);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(file);
+    return 0;
+  }
+  if (st.st_size == 0 && ftruncate(fd, sizeof(*leaders)) < 0) { // zeros: empty
+    perror(file);
+    close(fd);
+    return 0;
   }
+  map = st.st_size == 0 || st.st_size == sizeof(*leaders)
+      ? mmap(NULL, sizeof(*leaders), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+      : MAP_FAILED;
+  close(fd);
+  if (map == MAP_FAILED) {
+    puts("not a tetris leaderboard");
+    return 0;
+  }
+  leaders = map;
+  magic = 0; // new file: claim it
+  __atomic_compare_exchange_n(&leaders->magic, &magic, LEADERS_MAGIC, 0,
+                              __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&leaders->magic, __ATOMIC_ACQUIRE) != LEADERS_MAGIC) {
+    puts("not a tetris leaderboard");
+    munmap(map, sizeof(*leaders));
+    leaders = NULL;
+    return 0;
+  }
+  return 1;
 }
 
 
 /**
- * try to move the current block left.
- * This function updates the current_col variable, but does not
- * repaint the current block.
+ * insert game t, ending now, into the table; returns its entry.
  */
-void cmd_move_left( void ) {
-  current_col --;
-  if (test_if_block_fits()) return;
-  
-  // if we arrive here, the block doesn't fit,
-  // and we simply undo the column change.
-  current_col ++;	
+uint64_t leaders_record( const struct tetris *t ) {
+  uint64_t v, cur, entry;
+  unsigned char i;
+
+  v = t->score < 0xffffff ? t->score : 0xffffff;
+  v = v << 40 | (uint64_t) t->level << 32 | (uint32_t) time(NULL);
+  entry = v;
+
+  __atomic_fetch_add(&leaders->begun, 1, __ATOMIC_ACQ_REL);
+  for( i=0; i < LEADERS && v != 0; ) {
+    cur = __atomic_load_n(&leaders->entry[i], __ATOMIC_ACQUIRE);
+    if (v <= cur)
+      i++;
+    else if (__atomic_compare_exchange_n(&leaders->entry[i], &cur, v, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      v = cur; // pushed out, goes on below
+      i++;
+    }
+    // else changed by another writer, try this slot again
+  }
+  __atomic_fetch_add(&leaders->done, 1, __ATOMIC_RELEASE);
+  return entry;
 }
 
 
 /**
- * try to move the current block right.
- * This function updates the current_col variable, but does not
- * repaint the current block.
+ * a consistent copy of the table, without locks or system calls.
  */
-void cmd_move_right( void ) {
- current_col++;
-  if (test_if_block_fits()) return;
-  
-  // if we arrive here, the block doesn't fit,
-  // and we simply undo the column change.
-  current_col --;	
-}	
+void leaders_snapshot( uint64_t *e ) {
+  uint32_t b;
+  unsigned int try;
+  unsigned char i;
+
+  for( try=0; try < LEADERS_TRIES; try++ ) {
+    b = __atomic_load_n(&leaders->begun, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&leaders->done, __ATOMIC_ACQUIRE) != b)
+      continue; // a writer is at work
+    for( i=0; i < LEADERS; i++ )
+      e[i] = __atomic_load_n(&leaders->entry[i], __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&leaders->begun, __ATOMIC_RELAXED) == b)
+      return;
+  }
+  for( i=0; i < LEADERS; i++ )
+    e[i] = __atomic_load_n(&leaders->entry[i], __ATOMIC_ACQUIRE);
+}
 
 
 /**
- * try to rotate the current block.
- * This function updates the current_block(0..3) variables, 
- * but does not repaint the current block.
+ * show the table right of the board, entry v (the game that just
+ * ended) marked with '<' when it made it.
  */
-void cmd_rotate( char r ) {
-  rotate_block(r);
-  if (test_if_block_fits()) return;
-  
-  // if we arrive here, the block doesn't fit,
-  // and we undo the rotation by three more rotations...
-  rotate_block(-r);
+void display_leaders( uint64_t v ) {
+  uint64_t e[LEADERS];
+  unsigned int score;
+  unsigned char i;
+
+  leaders_snapshot(e);
+  vt_default_color();
+  vt100_goto( LEADERS_ROW, PANEL_COL );
+  vt100_puts( "Best games:" );
+  ses->cursor_col = PANEL_COL+11;
+  for( i=0; i < LEADERS && e[i] != 0 && LEADERS_ROW+1+i < PANEL_ROW; i++ ) {
+    vt100_goto( LEADERS_ROW+1+i, PANEL_COL );
+    vt100_xtoa( i+1 );
+    vt100_puts( "  " );
+    score = e[i] >> 40;
+    vt100_xtoa( score/10000 );
+    vt100_xtoa( score%10000/100 );
+    vt100_xtoa( score%100 );
+    vt100_puts( "  Level " );
+    vt100_xtoa( (e[i] >> 32) & 0xff );
+    vt100_puts( e[i] == v ? " <" : "  " );
+    ses->cursor_col = PANEL_COL+22;
+  }
 }
+#endif /* USE_LEADERS */
 
 
 /**
- * attempt to move the current block one position down.
- * If it doesn't fit, copy the current block to the gaming board
- * and check for completed rows. If any completed rows are found,
- * check_remove_completed_rows() also automatically repaints the 
- * whole gaming board.
- * Finally, we create a new random block (and let our caller
- * handle repainting the new block).
+ * sample the link to the terminal: measure its rate while it is busy
+ * (unless given with -b), and tell whether more than one frame budget
+ * of output is still waiting to be sent.
  */
-void cmd_move_down( void ) {
-  current_row++;
-  if (test_if_block_fits()) return; // fits
-  
-  if (current_row <= ROWNEW+2) { // already stuck right on top
-  	state |= GAME_OVER;
+unsigned char link_behind( void ) {
+  unsigned int backlog;
+  unsigned long done, budget;
+  int64_t now, dt;
+
+  backlog = vt100_backlog();
+  done = ses->link_total - backlog;
+  now = time_ns();
+  dt = now - ses->link_time_ns;
+  if (ses->link_busy && backlog > 0 && dt >= LINK_SAMPLE_NS && !ses->link_fixed) {
+    // busy all the time since the last sample: this is what the link does
+    budget = (done - ses->link_done) * 1000000000LL / dt;
+    ses->link_rate = ses->link_rate ? (ses->link_rate + budget) / 2 : budget;
   }
-  
-  // if we arrive here, the block doesn't fit,
-  // and we have to copy it to the game board.
-  // we also need a new random block...
-  current_row--;
-  display_block( PAINT_FIXED );  // this is now stuck
+  if (!ses->link_busy || backlog == 0 || dt >= LINK_SAMPLE_NS) {
+    ses->link_done = done;
+    ses->link_time_ns = now;
+  }
+  ses->link_busy = backlog > 0;
 
-  copy_block_to_gameboard();
-  check_remove_completed_rows(); // repaints all when necessary
+  if (ses->link_rate == 0) return 0; // no idea yet, draw everything
+  budget = ses->link_rate * FRAME_MS / 1000;
+  return backlog > budget;
+}
 
-  current_row = ROWNEW;
-  current_col = COLNEW;
-  
-  create_random_block();
-  score += SCORE_PER_BLOCK*(level+1);
-  
-  display_block( PAINT_ACTIVE );
-  display_score();
+
+/**
+ * show the current block in paintMode, or only remember to do so
+ * when the terminal is behind: intermediate positions of fast
+ * moves are then skipped and display_sync() sends the latest one.
+ */
+void display_active( unsigned char paintMode ) {
+  ses->active_mode = paintMode;
+  if (link_behind())
+    ses->active_dirty = 1;
+  else
+    display_block( &ses->game.cur, paintMode );
+}
+
+
+/**
+ * called when all commands are handled: catch up with the current
+ * block once the link has sent what it still had queued.
+ */
+void display_sync( void ) {
+  if (ses->active_dirty && !link_behind())
+    display_block( &ses->game.cur, ses->active_mode );
+}
+
+
+/**
+ * repaint what the engine reports changed by a step: a stuck block,
+ * removed rows, the new block, and the score.
+ */
+void display_events( unsigned char ev ) {
+  if (ev & EV_LOCKED) {
+    display_block( &ses->game.locked, PAINT_FIXED ); // this is now stuck
+    ses->shown_valid = 0;                            // and part of the board
+  }
+  if (ev & EV_ROWS)
+    display_rows();
+  if (ev & (EV_MOVED | EV_NEW_BLOCK))
+    display_active( PAINT_ACTIVE );
+  if (ev & EV_NEW_BLOCK)
+    ses->auto_plan = 1;
+  if (ev & EV_SCORE)
+    display_score();
+  if (ev & EV_GAME_OVER) {
+    ses->state |= GAME_OVER;
+#if USE_LEADERS
+    if (leaders)
+      display_leaders( leaders_record(&ses->game) );
+#endif
+  }
 }
 
 
@@ -1247,39 +1985,37 @@ void display_test_block( void ) {
 */
 
 
-// wraparound 10000 ms = 10 s
-int time_ms()
-{
-  struct timespec time_now;
-  clock_gettime(0, &time_now); // reads time
-  return (time_now.tv_sec%10)*1000 + time_now.tv_nsec/1000000;
-}
-
-
+/**
+ * absolute deadlines: the next step is one step after the previous
+ * deadline, not after now, so slow iterations don't shift the steps.
+ */
 void set_next_step_timeout(void)
 {
-  time_next_ms = (time_next_ms + step_ms) % MS_WRAPAROUND;
+  ses->time_next_ns += (int64_t) ses->game.step_ms*1000000;
 }
 
 
+/**
+ * milliseconds (rounded up) until the next step, 0 when it is due.
+ */
 int time_diff_ms()
 {
-  return (MS_WRAPAROUND + time_next_ms - time_ms()) % MS_WRAPAROUND;
+  int64_t diff;
+  diff = ses->time_next_ns - time_ns();
+  if(diff <= 0)
+    return 0;
+  return (diff + 999999) / 1000000;
 }
 
 
+
+
 #if USE_TERMIOS
 void set_read_timeout(void)
 {
   int time_diff;
   time_diff = time_diff_ms();
-  if(time_diff > MS_TIMEOUT) // if(time_ms()>time_next_ms)
-  {
-    current_termios.c_cc[VTIME] = 0;
-    time_next_ms = time_ms(); // CPU too slow -> skew
-  }
-  else
-    current_termios.c_cc[VTIME] = time_diff / 100; // ms -> 0.1s
+  current_termios.c_cc[VTIME] = time_diff / 100; // ms -> 0.1s
   ioctl(0, TCSETS, &current_termios);
 }
 #endif /* USE_TERMIOS */
@@ -1293,18 +2029,8 @@ int wait_key_or_timeout()
   int time_diff;
 
   time_diff = time_diff_ms();
-  if(time_diff > MS_TIMEOUT) /* if(time_ms()>time_next_ms) */
-  {
-    tv_tv_sec = 0;
-    tv.tv_usec = 0;
-    if(time_diff < MS_WRAPAROUND-step_ms)
-      time_next_ms = time_ms(); /* CPU too slow, >0.5s late -> skew */
-  }
-  else
-  {
-    tv.tv_sec  =  time_diff / 1000; /* ms -> s */
-    tv.tv_usec = (time_diff % 1000) * 1000; /* ms -> us fractional */
-  }
+  tv.tv_sec  =  time_diff / 1000; /* ms -> s */
+  tv.tv_usec = (time_diff % 1000) * 1000; /* ms -> us fractional */
 
   FD_ZERO(&fds);
   FD_SET(0, &fds);
@@ -1313,152 +2039,354 @@ int wait_key_or_timeout()
 #endif /* USE_SELECT */
 
 
+#if USE_POLL
+/**
+ * wait until a key is available or ms milliseconds passed
+ * (-1: wait forever). Returns >0 if a key can be read.
+ * Pending output is sent as soon as the terminal can take more.
+ */
+int wait_key( int ms )
+{
+  struct pollfd fds[2];
+  int r;
+
+  fds[0].fd = 0;
+  fds[0].events = POLLIN;
+  fds[1].fd = 1;
+  fds[1].events = POLLOUT;
+  r = poll(fds, ses->outbuf_len > ses->outbuf_start ? 2 : 1, ms);
+  STAT_COUNT(polls);
+  if (r <= 0) return r;
+  if (ses->outbuf_len > ses->outbuf_start && fds[1].revents)
+    vt100_flush();
+  return fds[0].revents;
+}
+
+
+int wait_key_or_timeout()
+{
+  int ms;
+
+  ms = time_diff_ms();
+  if (ses->active_dirty && ms > FRAME_RETRY_MS) // see if the link caught up
+    ms = FRAME_RETRY_MS;
+  return wait_key(ms);
+}
+#endif /* USE_POLL */
+
+
 void init_game( void ) {
-  unsigned char i;
-  if(VT52_mode)
+  ses->sgr_color = SGR_UNKNOWN; // terminal state unknown, send colors again
+  if(ses->VT52_mode)
     vt100_enter_vt52_mode();
   else
     vt_default_color();
   vt100_clear_screen();
-  clear_board();
+  tetris_new_game(&ses->game, MAX_level);
   display_board(ROWSD,0);
 
-  free_rows = ROWS;
-  for(i = 0; i < 7; i++)
-  {
-    active_pool = 1;
-    shuffle_inactive_pool();
-    active_pool = 0;
-    shuffle_inactive_pool();
-  }
-  current_row = ROWNEW;
-  current_col = COLNEW;
-  create_random_block();
-
-  score = 0;
-  lines = 0;
-  level = 1;
-  time_next_ms = time_ms();
-  step_ms = MS_STEP_START; // level 1 step 1 s -> level 9 step 0.1 s
+  ses->time_next_ns = time_ns();
   set_next_step_timeout();
 
-  state = STATE_IDLE;
-  command = CMD_NONE;
+  ses->state = STATE_IDLE;
+  ses->command = CMD_NONE;
   display_score();
-  display_block( PAINT_ACTIVE );
+  ses->shown_valid = 0;
+  display_block( &ses->game.cur, PAINT_ACTIVE );
+  ses->auto_plan = 1;
 }
 
 
-bit gameover( void ) {
-  return (state & GAME_OVER) != 0;	
+#if USE_SERVER
+/**
+ * show the options of the current session on the menu status line.
+ */
+void menu_status( void ) {
+  vt100_puts( "\roptions:" );
+  vt100_puts( ses->VT52_mode ? " -v" : "   " );
+  vt100_puts( ses->VT100_color ? "   " : " -m" );
+  vt100_puts( ses->VT100_scroll ? "   " : " -s" );
+  vt100_puts( ses->DRAW_multi == 1 ? " -c" : "   " );
+  vt100_puts( ses->VT100_rep ? " -e" : "   " );
+  vt100_puts( ses->INFINITE_time ? " -i" : "   " );
 }
 
 
-bit timeout( void ) {
-  return (state & TIMEOUT) != 0;	
+void menu_show( void ) {
+  vt100_puts( "\r\nTetris for Terminals\r\n\r\n"
+              " v : VT52 mode (no colors)\r\n"
+              " m : VT100 monochrome\r\n"
+              " s : VT100 no scroll controls\r\n"
+              " c : single-char width (8x8 font)\r\n"
+              " e : VT100 compress runs with REP/ECH\r\n"
+              " i : infinite time\r\n"
+              " w : watch a game (w : next game, r : redraw)\r\n"
+              " space or enter : play, q : quit\r\n\r\n" );
+  menu_status();
 }
 
 
-void check_handle_command( void ) {
-  unsigned char tmp;
-  signed char previous_row;
+/**
+ * bring a watcher that joins or missed frames up to date: the screen
+ * of the watched game from its shadow screen, in its terminal modes,
+ * left in the state the player's next frame starts from.
+ */
+void watch_snapshot( void ) {
+  struct session *p;
+  unsigned char r, c, ch, color;
+  unsigned long n;
+
+  p = ses->watch;
+  ses->DRAW_multi = p->DRAW_multi;
+  ses->VT52_mode = p->VT52_mode;
+  ses->VT100_color = p->VT100_color;
+  ses->VT100_scroll = p->VT100_scroll;
+  ses->VT100_rep = p->VT100_rep;
+  n = ses->game.fit_tests;
+  ses->game = p->game; // for the score
+  ses->game.fit_tests = n; // not tested here
+
+  ses->sgr_color = SGR_UNKNOWN;
+  if(ses->VT52_mode)
+    vt100_enter_vt52_mode();
+  else
+    vt_default_color();
+  vt100_clear_screen();
+  for(r = 0; r < SCREEN_ROWS; r++)
+    for(c = 0; c < SCREEN_CELLS; c++)
+    {
+      ch = p->shadow_ch[r][c];
+      color = p->shadow_color[r][c];
+      if (ch == CHAR_SPACE && color == COLOR_DEFAULT) continue;
+      if (ses->VT52_mode == 0 && ses->VT100_color && color != ses->sgr_color)
+      {
+        vt100_send_pending( CURSOR_UNKNOWN, 0 );
+        vt100_bgcolor( color );
+      }
+      display_cell( r, c, ch, color );
+    }
+  vt100_send_pending( CURSOR_UNKNOWN, 0 );
+  display_score();
 
-  if(command == CMD_QUIT || command == CMD_CTRLC)
-    exit(0);
+  if (p->cursor_row != CURSOR_UNKNOWN)
+    vt100_goto( p->cursor_row, p->cursor_col );
+  if (ses->VT52_mode == 0 && ses->VT100_color && p->sgr_color != SGR_UNKNOWN)
+    vt100_bgcolor( p->sgr_color );
+  ses->watch_behind = 0;
+}
 
-  // if the game is over, we only react to the 's' restart command.
-  // 
-  if (gameover()) {
-    step_ms = MS_STEP_START; // reduce CPU usage during game over
-    if (command == CMD_START) {
-  	  init_game();	
-    }
-    return;
-  }
 
-  // first check game status and a possible timeout.
-  if (timeout() || command == CMD_DOWN) {
-    // decide hardware scroll or repaint
-    tmp = ~VT52_mode && VT100_scroll && current_row > ROW0 && current_row < free_rows-ROW0-3;
-    if(tmp)
-    { /* hardware scroll */
-      vt_default_color();
-      vt100_scroll_region_down(current_row+3);
-      display_board(1,1); /* repaint top row */
-      vt100_cursor_home();
+/**
+ * stop watching: leave the watcher list of the game.
+ */
+void watch_detach( void ) {
+  struct session **w;
+
+  for( w = &ses->watch->watchers; *w; w = &(*w)->watch_next )
+    if (*w == ses) {
+      *w = ses->watch_next;
+      break;
     }
-    else
-      display_block( ERASE );
-    cmd_move_down();
-    if(tmp == 0)
-      display_block( PAINT_ACTIVE );
-    state &= ~TIMEOUT; // reset timeout flag
+  ses->watch = NULL;
+}
+
+
+bit watchable( const struct session *p ) {
+  return p != ses && !(p->state & (MENU | WATCH | QUIT));
+}
+
+
+/**
+ * watch the next game after the one watched (or the first one),
+ * stay in the menu when nobody plays.
+ */
+void watch_next_game( void ) {
+  struct session *p, *s, *from;
+
+  from = ses->watch ? ses->watch->next : sessions;
+  p = NULL;
+  for( s = from; s && !p; s = s->next ) // after the current one
+    if (watchable(s)) p = s;
+  for( s = sessions; s != from && !p; s = s->next ) // wrap around
+    if (watchable(s)) p = s;
+  if (p == NULL) {
+    vt100_puts( "\r\nno game to watch\r\n" );
+    menu_status();
     return;
   }
 
-  // now, check whether we have a command. If so, handle it.
-  tmp = command;
-  command = CMD_NONE;
+  if (ses->watch)
+    watch_detach();
+  ses->watch = p;
+  ses->watch_next = p->watchers;
+  p->watchers = ses;
+  ses->state = WATCH;
+  watch_snapshot();
+}
 
-  switch( tmp )
+
+/**
+ * a key while watching: next game or redraw.
+ */
+void watch_command( void ) {
+  switch( ses->command )
   {
-    case CMD_NONE: // idle
+    case 'w':
+      watch_next_game();
       break;
-
-    case CMD_LEFT: // try to move the current block left
-      display_block( ERASE );
-      cmd_move_left();
-      display_block( PAINT_ACTIVE );
+    case CMD_REDRAW:
+      watch_snapshot();
       break;
+  }
+}
 
-    case CMD_ROTATE_CCW: // try to rotate the current block
-      display_block( ERASE );
-      cmd_rotate(1);
-      display_block( PAINT_ACTIVE );
-      break;
 
-    case CMD_ROTATE_CW: // try to rotate the current block
-      display_block( ERASE );
-      cmd_rotate(-1);
-      display_block( PAINT_ACTIVE );
-      break;
+/**
+ * a key in the menu: toggle an option or start the game.
+ */
+void menu_command( void ) {
+  switch( ses->command )
+  {
+    case 'v':
+      ses->VT52_mode ^= 1;
+      ses->VT100_color = ses->VT100_scroll = !ses->VT52_mode;
+      ses->VT100_rep = 0;
+      break;
+    case 'm': if (!ses->VT52_mode) ses->VT100_color ^= 1; break;
+    case 's': if (!ses->VT52_mode) ses->VT100_scroll ^= 1; break;
+    case 'c': ses->DRAW_multi = 3 - ses->DRAW_multi; break;
+    case 'e': if (!ses->VT52_mode) ses->VT100_rep ^= 1; break;
+    case 'i': ses->INFINITE_time ^= 1; break;
+    case 'w':
+      watch_next_game();
+      return;
+    case ' ':
+    case '\r':
+    case '\n':
+      ses->state &= ~MENU;
+      init_game();
+      return;
+    default:
+      return;
+  }
+  menu_status();
+}
+#endif /* USE_SERVER */
+
+
+bit gameover( void ) {
+  return (ses->state & GAME_OVER) != 0;	
+}
+
+
+bit timeout( void ) {
+  return (ses->state & TIMEOUT) != 0;	
+}
+
+
+void check_handle_command( void ) {
+  unsigned char tmp, ev;
+
+  if(ses->command == CMD_QUIT || ses->command == CMD_CTRLC) {
+    ses->state |= QUIT;
+    return;
+  }
+
+#if USE_SERVER
+  if (ses->state & MENU) {
+    menu_command();
+    return;
+  }
+  if (ses->state & WATCH) {
+    watch_command();
+    return;
+  }
+#endif
+
+  // if the game is over, we only react to the 's' restart command.
+  // 
+  if (gameover()) {
+    ses->game.step_ms = MS_STEP_START; // reduce CPU usage during game over
+    if (ses->command == CMD_START) {
+  	  init_game();	
+    }
+    return;
+  }
+
+  // first check game status and a possible timeout.
+  if (timeout() || ses->command == CMD_DOWN) {
+    // decide hardware scroll or repaint
+    // (only when the terminal shows the block where it is now)
+    tmp = !ses->VT52_mode && ses->VT100_scroll && ses->game.cur.row > ROW0
+          && ses->game.cur.row < ses->game.free_rows-ROW0-3 && ses->shown_valid && !ses->active_dirty;
+    if(tmp)
+    { /* hardware scroll */
+      vt_default_color();
+      vt100_scroll_region_down(ses->game.cur.row+3, 1);
+      ses->shown.row++; // scrolled down with the board
+      display_board(1,1); /* repaint top row */
+      if (!ses->panel_valid)
+        display_score(); // the region reached the panel
+    }
+    ev = tetris_down(&ses->game);
+    if(tmp)
+      ev &= ~EV_MOVED; // already there
+    display_events(ev);
+    ses->state &= ~TIMEOUT; // reset timeout flag
+    return;
+  }
+
+  // now, check whether we have a command. If so, handle it.
+  tmp = ses->command;
+  ses->command = CMD_NONE;
+
+  switch( tmp )
+  {
+    case CMD_NONE: // idle
+      break;
+
+    case CMD_LEFT: // try to move the current block left
+      display_events( tetris_left(&ses->game) );
+      break;
+
+    case CMD_ROTATE_CCW: // try to rotate the current block
+      display_events( tetris_rotate(&ses->game, 1) );
+      break;
+
+    case CMD_ROTATE_CW: // try to rotate the current block
+      display_events( tetris_rotate(&ses->game, -1) );
+      break;
 
     case CMD_RIGHT: // try to move the current block right
-      display_block( ERASE );
-      cmd_move_right();
-      display_block( PAINT_ACTIVE );
+      display_events( tetris_right(&ses->game) );
       break;
 
     case CMD_DROP: // drop the current block
-      display_block( ERASE );
-      previous_row = current_row;
-      for( ; test_if_block_fits(); )
-        current_row++;
+      ev = tetris_drop(&ses->game);
 
-      // now one step back, then paint the block in its
-      // final position and allow to move left-right
-      // before sticking it finally
-      current_row--;
-      display_block( PAINT_FIXED );
+      // paint the block in its final position and
+      // allow to move left-right before sticking it finally
+      display_active( PAINT_FIXED );
 
       // this will stick block immediately
       // and not allow to move it left-right after dropping
-      if(INFINITE_time)
-        cmd_move_down();
-      else if (current_row != previous_row)
+      if(ses->INFINITE_time)
+        display_events( tetris_down(&ses->game) );
+      else if (ev & EV_MOVED)
       {
         /* after drop, reset step time to proprely delay final "stick" */
-        time_next_ms = time_ms();
+        ses->time_next_ns = time_ns();
         set_next_step_timeout();
       }
       break;
 
     case CMD_REDRAW: // redraw everything
+      ses->sgr_color = SGR_UNKNOWN;
       vt_default_color();
       vt100_clear_screen();
       display_board(ROWSD,0);
       display_score();
-      display_block( PAINT_ACTIVE );
+      display_block( &ses->game.cur, PAINT_ACTIVE );
       break;
 
     case CMD_START: // quit and (re-) start the game
@@ -1472,91 +2400,1606 @@ void check_handle_command( void ) {
 }
 
 
-void isr( void ) {
+unsigned char queue_free( void ) {
+  return QUEUE_SIZE-1 - ((ses->queue_head - ses->queue_tail) & (QUEUE_SIZE-1));
+}
+
+
+void queue_put( unsigned char cmd ) {
+  if (queue_free() == 0) return; // full, drop
+  ses->queue[ses->queue_head] = cmd;
+  ses->queue_head = (ses->queue_head+1) & (QUEUE_SIZE-1);
+}
+
+
+/**
+ * take the next command from the queue, CMD_NONE if empty.
+ */
+unsigned char queue_get( void ) {
+  unsigned char cmd;
+  if (ses->queue_head == ses->queue_tail) return CMD_NONE;
+  cmd = ses->queue[ses->queue_tail];
+  ses->queue_tail = (ses->queue_tail+1) & (QUEUE_SIZE-1);
+  return cmd;
+}
+
+
+/**
+ * queue one received byte. The arrow keys 'ESC [ A..D' (or 'ESC O A..D')
+ * are translated to rotate, down, right and left.
+ */
+void queue_key( unsigned char ch ) {
+  if (ses->esc_state == 2) {
+    ses->esc_state = 0;
+    switch( ch ) {
+      case 'A': queue_put( CMD_ROTATE_CW ); return;
+      case 'B': queue_put( CMD_DOWN );      return;
+      case 'C': queue_put( CMD_RIGHT );     return;
+      case 'D': queue_put( CMD_LEFT );      return;
+    }
+  }
+  if (ses->esc_state == 1 && (ch == '[' || ch == 'O')) {
+    ses->esc_state = 2;
+    return;
+  }
+  ses->esc_state = ch == 27;
+  if (ch < 0x80 && ch != 27)
+    queue_put( ch );
+}
+
+
+/**
+ * queue a tick for every step that is due.
+ */
+void queue_ticks( void ) {
+  while(time_diff_ms() == 0 && queue_free() > 0) // next step is due
+  {
+    if(time_ns() - ses->time_next_ns > (int64_t) MS_TIMEOUT*1000000)
+      ses->time_next_ns = time_ns(); // far too late -> skew
+    set_next_step_timeout();
+    queue_put( CMD_TICK );
+  }
+}
+
+
+/**
+ * the session is finished: the player quit, or the game is over
+ * and we should exit then.
+ */
+bit session_over( void ) {
+  return (ses->state & QUIT) ||
+         ((ses->state & GAME_OVER) && EXIT_after_game_over);
+}
+
+
+#if USE_REPLAY
+/*
+ * replay files (-R, -P): "TTR1", the seed, MAX_level and the flags
+ * (1: INFINITE_time), then one record per command as two unsigned
+ * LEB128 varints: the ticks since the last record shifted left by 4
+ * or'ed with the command code (see replay_cmds), and the milliseconds
+ * since the last record. Code 0 ends the file. The ticks are counted,
+ * they are the steps queued by queue_ticks(), not times, so that
+ * playing the commands back gives the same game on any clock.
+ */
+#define REPLAY_MAGIC "TTR1"
+#define REPLAY_BUF   4096
+#define REPLAY_INFINITE 1
+
+// command of each code, 0: end
+static const unsigned char replay_cmds[] = {
+  0, CMD_LEFT, CMD_RIGHT, CMD_ROTATE_CCW, CMD_ROTATE_CW, CMD_DOWN,
+  CMD_DROP, CMD_START, CMD_REDRAW, CMD_QUIT
+};
+
+static int replay_fd = -1;     // -R: recording
+static unsigned char replay_buf[REPLAY_BUF];
+static unsigned int  replay_len;
+static unsigned long replay_ticks;
+static int64_t replay_time_ns;
+
+
+void replay_write( void ) {
+  if (replay_len > 0 && write(replay_fd, replay_buf, replay_len) < 0)
+    perror("tetris -R");
+  replay_len = 0;
+}
+
+
+/**
+ * append v to the recording as a varint: 7 bits per byte, low bits
+ * first, the top bit set while more follow.
+ */
+void replay_put( unsigned long v ) {
+  if (replay_len > REPLAY_BUF-10) replay_write();
+  while( v >= 0x80 ) {
+    replay_buf[replay_len++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  replay_buf[replay_len++] = v;
+}
+
+
+/**
+ * record one command taken from the queue by session_run().
+ */
+void replay_record( unsigned char cmd ) {
+  unsigned char code;
+  int64_t now;
+
+  if (cmd == CMD_TICK) {
+    replay_ticks++;
+    return;
+  }
+  if (cmd == CMD_CTRLC) cmd = CMD_QUIT;
+  for(code = 1; code < sizeof(replay_cmds) && replay_cmds[code] != cmd; code++)
+    ;
+  if (code == sizeof(replay_cmds)) return; // does nothing in a game
+
+  now = time_ns();
+  replay_put( replay_ticks << 4 | code );
+  replay_put( (now - replay_time_ns) / 1000000 );
+  replay_time_ns = now;
+  replay_ticks = 0;
+}
+
+
+/**
+ * end the recording (at exit): the ticks after the last command.
+ */
+void replay_close( void ) {
+  replay_put( replay_ticks << 4 );
+  replay_put( (time_ns() - replay_time_ns) / 1000000 );
+  replay_write();
+  close(replay_fd);
+}
+
+
+/**
+ * start recording the games of the console to file.
+ */
+bit replay_open( const char *file ) {
+  replay_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (replay_fd < 0) {
+    perror(file);
+    return 0;
+  }
+  memcpy(replay_buf, REPLAY_MAGIC, 4);
+  replay_len = 4;
+  replay_put( RAND_seed );
+  replay_put( MAX_level );
+  replay_put( ses->INFINITE_time ? REPLAY_INFINITE : 0 );
+  replay_time_ns = time_ns();
+  atexit(replay_close);
+  return 1;
+}
+#endif /* USE_REPLAY */
+
+
+/**
+ * handle the queued commands and ticks, then send the frame.
+ */
+void session_run( void ) {
+  do {
+    ses->command = queue_get();
+#if USE_REPLAY
+    if(replay_fd >= 0)
+      replay_record(ses->command);
+#endif
+    if(ses->command == CMD_TICK)
+    {
+      ses->command = CMD_NONE;
+      ses->state |= TIMEOUT;
+    }
+    check_handle_command();
+  } while( ses->queue_head != ses->queue_tail && !session_over() );
+
+  // all queued commands done, send the frame
+  display_sync();
+  vt100_park_cursor();
+  vt100_flush();
+#if USE_STATS
+  stat_frame();
+#endif
+}
+
+
+/**
+ * autoplay (-a): the keys that take the current block to where
+ * tetris_plan() wants it, ending with a drop. Returns their number,
+ * at most AUTOPLAY_KEYS.
+ */
+#define AUTOPLAY_KEYS (3+COLS+1)
+
+unsigned char autoplay_keys( const struct tetris *t, unsigned char *keys ) {
+  struct tetris_block move;
+  unsigned char n, r;
+  signed char c;
+
+  n = 0;
+  if (tetris_plan(t, &move)) {
+    for( r = t->cur.rotation; r != move.rotation; r = (r+1)&3 )
+      keys[n++] = CMD_ROTATE_CCW;
+    for( c = t->cur.col; c > move.col; c-- )
+      keys[n++] = CMD_LEFT;
+    for( ; c < move.col; c++ )
+      keys[n++] = CMD_RIGHT;
+  }
+  keys[n++] = CMD_DROP;
+  return n;
+}
+
+
+#if USE_STATS
+/**
+ * write the statistics to stderr (at exit, and on SIGUSR1): the bytes
+ * sent by category, the syscalls, the fit tests of all games and the
+ * histogram of the latency from input to frame.
+ */
+void stats_report( void ) {
+  static const char *cats[STAT_CATS] = { " goto ", " sgr ", " glyphs ", " scroll ", " other " };
+  char line[256+STAT_HIST*32], *p;
+  unsigned long total, fits;
+  int64_t ms;
+  unsigned char k;
+#if USE_SERVER
+  struct session *s;
+#endif
+
+  stats_due = 0;
+  ms = (time_ns() - stats.start_ns) / 1000000;
+  if (ms < 1) ms = 1;
+
+  total = 0;
+  for(k = 0; k < STAT_CATS; k++)
+    total += stats.bytes[k];
+  p = text_str(line, "bytes: ");
+  p = text_num(p, total);
+  for(k = 0; k < STAT_CATS; k++) {
+    p = text_str(p, cats[k]);
+    p = text_num(p, stats.bytes[k]);
+  }
+  p = text_str(p, ", frames ");
+  p = text_num(p, stats.frames);
+  p = text_str(p, ", bytes/frame ");
+  p = text_num(p, stats.frames ? total / stats.frames : 0);
+  *p++ = '\n';
+
+  p = text_str(p, "syscalls: write ");
+  p = text_num(p, stats.writes);
+  p = text_str(p, " read ");
+  p = text_num(p, stats.reads);
+  p = text_str(p, " ioctl ");
+  p = text_num(p, stats.ioctls);
+  p = text_str(p, " poll ");
+  p = text_num(p, stats.polls);
+  *p++ = '\n';
+
+  fits = stats.fit_tests + console.game.fit_tests;
+#if USE_SERVER
+  for(s = sessions; s; s = s->next)
+    fits += s->game.fit_tests;
+#endif
+  p = text_str(p, "fit tests: ");
+  p = text_num(p, fits);
+  p = text_str(p, " in ");
+  p = text_num(p, ms);
+  p = text_str(p, " ms, ");
+  p = text_num(p, fits * 1000 / ms);
+  p = text_str(p, "/s\n");
+
+  p = text_str(p, "input to frame, us:");
+  for(k = 0; k < STAT_HIST; k++) {
+    if (stats.latency[k] == 0) continue;
+    p = text_str(p, "  <");
+    p = text_num(p, 1UL << k);
+    p = text_str(p, ": ");
+    p = text_num(p, stats.latency[k]);
+  }
+  *p++ = '\n';
+  if (write(2, line, p-line) < 0) return; // nowhere to report
+}
+
+
+void stats_start( void ) {
+  struct sigaction sa;
+
+  stats.start_ns = time_ns();
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stat_signal; // no SA_RESTART: wakes up the waiting loop
+  sigaction(SIGUSR1, &sa, NULL);
+  atexit(stats_report);
+}
+#endif /* USE_STATS */
+
+
+/**
+ * read the keys that fit in the command queue, returns what read()
+ * returned.
+ */
+int key_read( int fd, unsigned char *buf ) {
   int r;
-  char buf[2];
 
-  if(INFINITE_time)
-  { /* player can think forever */
-    r = read(0, buf, 1);
-    if (r > 0)
-      command = buf[0];
+  r = read(fd, buf, queue_free());
+  STAT_COUNT(reads);
+#if USE_STATS
+  if (r > 0) stat_input();
+#endif
+  return r;
+}
+
+
+/**
+ * wait for input or the next step, then queue everything that is
+ * available with one read(), and a tick for every step that is due.
+ * With autoplay a new block or game is started right away instead.
+ */
+void isr( void ) {
+  int r, i;
+  unsigned char buf[QUEUE_SIZE];
+
+  if(AUTO_play && (ses->auto_plan || gameover()))
+  { /* no waiting, but keys like 'q' still count */
+    if(gameover())
+      queue_put(CMD_START);
     else
-      command = 0;
+      for(r = autoplay_keys(&ses->game, buf), i = 0; i < r; i++)
+        queue_put(buf[i]);
+    ses->auto_plan = 0;
+    r = key_read(0, buf); // VMIN 0: returns at once
+    for(i = 0; i < r; i++)
+      queue_key(buf[i]);
+    return;
+  }
+
+  if(ses->INFINITE_time)
+  { /* player can think forever */
+    #if USE_POLL
+    r = wait_key(ses->active_dirty ? FRAME_RETRY_MS : -1);
+    if(r > 0)
+    #endif
+    r = key_read(0, buf);
   }
   else
   { /* player must think fast */
     #if USE_TERMIOS
     set_read_timeout();
-    r = read(0, buf, 1);
+    r = key_read(0, buf);
     #endif
-    #if USE_SELECT
+    #if USE_SELECT || USE_POLL
     r = wait_key_or_timeout();
     if(r > 0)
-      r = read(0, buf, 1);
+      r = key_read(0, buf);
     #endif
-    if (r > 0)
-      command = buf[0];
-    else
-      command = 0;
+  }
+
+  for(i = 0; i < r; i++)
+    queue_key(buf[i]);
+
+  if(ses->INFINITE_time)
+    return;
+
+  queue_ticks();
+}
+
 
-    if(time_diff_ms() > MS_TIMEOUT) // time_ms() > time_next_ms
+#if USE_SERVER
+/*
+ * telnet server: one session per connection, all on one epoll loop.
+ * The gravity deadlines of all sessions are kept in a timer wheel of
+ * WHEEL_SLOTS slots, WHEEL_TICK_MS apart, so that a step costs the
+ * same with 5 or 500 players. A new player first gets a menu to pick
+ * the terminal options.
+ */
+#define WHEEL_SLOTS   256 // power of 2, covers more than MS_TIMEOUT
+#define WHEEL_TICK_NS 8000000
+#define EPOLL_EVENTS  64
+
+#define IAC   255 // telnet commands
+#define SB    250
+#define SE    240
+#define WILL  251
+#define DO    253
+#define TELOPT_ECHO      1
+#define TELOPT_SGA       3
+#define TELOPT_LINEMODE 34
+
+static struct session *wheel[WHEEL_SLOTS];
+static int64_t wheel_now; // last tick handled
+
+
+void wheel_remove( struct session *s ) {
+  if (s->wheel_prev == NULL) return;
+  *s->wheel_prev = s->wheel_next;
+  if (s->wheel_next) s->wheel_next->wheel_prev = s->wheel_prev;
+  s->wheel_prev = NULL;
+}
+
+
+void wheel_insert( struct session *s, int64_t at_ns ) {
+  struct session **slot;
+
+  s->wheel_tick = (at_ns + WHEEL_TICK_NS-1) / WHEEL_TICK_NS;
+  if (s->wheel_tick <= wheel_now) s->wheel_tick = wheel_now+1;
+  slot = &wheel[s->wheel_tick & (WHEEL_SLOTS-1)];
+  s->wheel_next = *slot;
+  if (*slot) (*slot)->wheel_prev = &s->wheel_next;
+  s->wheel_prev = slot;
+  *slot = s;
+}
+
+
+/**
+ * put the current session back into the wheel for its next step, or
+ * earlier when the coalesced block still has to be sent.
+ */
+void session_schedule( void ) {
+  int64_t at;
+
+  wheel_remove(ses);
+  at = INT64_MAX;
+  if (!(ses->state & (MENU | WATCH)) && !ses->INFINITE_time)
+    at = ses->time_next_ns;
+  if (ses->active_dirty && at > time_ns() + FRAME_RETRY_MS*1000000LL)
+    at = time_ns() + FRAME_RETRY_MS*1000000LL;
+  if (at != INT64_MAX)
+    wheel_insert(ses, at);
+}
+
+
+/**
+ * queue one byte received from a telnet client, without the telnet
+ * commands (option negotiation) mixed into the stream.
+ */
+void telnet_key( unsigned char ch ) {
+  switch( ses->telnet_state )
+  {
+    case 0: // data
+      if (ch == IAC) ses->telnet_state = 1;
+      else queue_key(ch);
+      break;
+    case 1: // after IAC
+      if (ch == SB) ses->telnet_state = 3;
+      else if (ch >= WILL) ses->telnet_state = 2; // WILL WONT DO DONT option
+      else ses->telnet_state = 0; // IAC IAC (not a 7-bit key) and others
+      break;
+    case 2: // option
+      ses->telnet_state = 0;
+      break;
+    case 3: // subnegotiation up to IAC SE
+      if (ch == IAC) ses->telnet_state = 4;
+      break;
+    case 4:
+      ses->telnet_state = ch == SE ? 0 : 3;
+      break;
+  }
+}
+
+
+/**
+ * after handling the current session: close it when the player left,
+ * otherwise reschedule it and wait for the socket to take the output.
+ * The watchers of a game that ends go back to the menu.
+ */
+void session_done( void ) {
+  struct session *p, **s;
+
+  if (ses->state & QUIT) {
+    vt_reset();
+    vt100_flush();
+    if (ses->watch)
+      watch_detach();
+    p = ses;
+    while( p->watchers ) {
+      ses = p->watchers;
+      p->watchers = ses->watch_next;
+      ses->watch = NULL;
+      ses->state = MENU;
+      menu_show();
+      vt100_flush();
+      session_want_out(ses);
+    }
+    ses = p;
+    for( s = &sessions; *s; s = &(*s)->next )
+      if (*s == ses) {
+        *s = ses->next;
+        break;
+      }
+    wheel_remove(ses);
+    close(ses->fd); // also removes it from epoll
+#if USE_STATS
+    stats.fit_tests += ses->game.fit_tests;
+#endif
+    free(ses);
+    ses = &console;
+    return;
+  }
+  // a watcher that missed frames gets a snapshot once it has sent the rest
+  if ((ses->state & WATCH) && ses->watch_behind && ses->outbuf_len == ses->outbuf_start) {
+    watch_snapshot();
+    vt100_flush();
+  }
+  session_schedule();
+  session_want_out(ses);
+}
+
+
+/**
+ * accept a new player: the server echoes (nothing) and sends every key
+ * at once, not line by line, and starts with the menu.
+ */
+void session_accept( int listen_fd ) {
+  static const unsigned char negotiate[] = {
+    IAC, WILL, TELOPT_ECHO, IAC, WILL, TELOPT_SGA, IAC, DO, TELOPT_SGA,
+    IAC, 254, TELOPT_LINEMODE // DONT
+  };
+  struct epoll_event ev;
+  struct session *s;
+  unsigned int i;
+  int fd;
+
+  while( (fd = accept(listen_fd, NULL, NULL)) >= 0 ) {
+    s = malloc(sizeof(*s));
+    if (s == NULL) { close(fd); continue; }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    session_init(s, fd);
+    // the command line options are the defaults
+    s->DRAW_multi = console.DRAW_multi;
+    s->VT52_mode = console.VT52_mode;
+    s->VT100_color = console.VT100_color;
+    s->VT100_scroll = console.VT100_scroll;
+    s->VT100_rep = console.VT100_rep;
+    s->INFINITE_time = console.INFINITE_time;
+    s->link_rate = console.link_rate;
+    s->link_fixed = console.link_fixed;
+    s->state = MENU;
+    tetris_seed(&s->game, tetris_random(&console.game.rand_state)); // each its own blocks
+    s->next = sessions;
+    sessions = s;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = s;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+
+    ses = s;
+    for(i = 0; i < sizeof(negotiate); i++)
+      vt100_putc(negotiate[i]);
+    menu_show();
+    vt100_flush();
+    session_done();
+  }
+}
+
+
+/**
+ * read what the client sent, as much as the command queue takes.
+ */
+void session_read( void ) {
+  unsigned char buf[QUEUE_SIZE];
+  int r, i;
+
+  while( queue_free() > 0 ) {
+    r = key_read(ses->fd, buf);
+    if (r < 0 && errno == EINTR) continue;
+    if (r < 0 && errno == EAGAIN) break;
+    if (r <= 0) { // connection closed
+      ses->state |= QUIT;
+      break;
+    }
+    for(i = 0; i < r; i++)
+      telnet_key(buf[i]);
+  }
+}
+
+
+/**
+ * run all sessions whose step is due.
+ */
+void wheel_run( void ) {
+  struct session *s, *next;
+  int64_t now_tick;
+
+  now_tick = time_ns() / WHEEL_TICK_NS;
+  if (now_tick - wheel_now > WHEEL_SLOTS) // slept: look at every slot once
+    wheel_now = now_tick - WHEEL_SLOTS;
+  while( wheel_now < now_tick ) {
+    wheel_now++;
+    s = wheel[wheel_now & (WHEEL_SLOTS-1)];
+    wheel[wheel_now & (WHEEL_SLOTS-1)] = NULL;
+    for( ; s; s = next ) {
+      next = s->wheel_next;
+      s->wheel_prev = NULL;
+      if (s->wheel_tick > wheel_now) { // a later round
+        wheel_insert(s, s->wheel_tick * WHEEL_TICK_NS);
+        continue;
+      }
+      ses = s;
+      if (!ses->INFINITE_time)
+        queue_ticks();
+      session_run();
+      session_done();
+    }
+  }
+}
+
+
+int server_main( int port ) {
+  struct sockaddr_in addr;
+  struct epoll_event events[EPOLL_EVENTS];
+  int listen_fd, n, i, one;
+
+  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  one = 1;
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+      || listen(listen_fd, 128) < 0) {
+    perror("tetris -S");
+    return 1;
+  }
+  fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+  epoll_fd = epoll_create1(0);
+  events[0].events = EPOLLIN;
+  events[0].data.ptr = NULL; // the listening socket
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &events[0]);
+
+  signal(SIGPIPE, SIG_IGN); // a client went away: write() fails instead
+  EXIT_after_game_over = 0; // players restart with 's' or quit with 'q'
+  wheel_now = time_ns() / WHEEL_TICK_NS;
+
+  for(;;) {
+    n = epoll_wait(epoll_fd, events, EPOLL_EVENTS,
+                   (WHEEL_TICK_NS - time_ns() % WHEEL_TICK_NS + 999999) / 1000000);
+    STAT_COUNT(polls);
+    for(i = 0; i < n; i++) {
+      if (events[i].data.ptr == NULL) {
+        session_accept(listen_fd);
+        continue;
+      }
+      ses = events[i].data.ptr;
+      if (events[i].events & EPOLLOUT)
+        vt100_flush();
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        session_read();
+        if (ses->queue_head != ses->queue_tail)
+          session_run();
+      }
+      session_done();
+    }
+    wheel_run();
+#if USE_STATS
+    if (stats_due) stats_report();
+#endif
+  }
+}
+#endif /* USE_SERVER */
+
+#if USE_HEADLESS
+/*
+ * headless simulation (--headless): games of the engine alone, no
+ * terminal, on a virtual clock, for tuning the speed and scoring.
+ * The moves come from a script of command keys, played in a loop from
+ * the start in every game, or are random keys without a script. Every
+ * key takes the virtual time HEADLESS_KEY_MS, so there are fewer moves
+ * per step at higher levels, as for a player; any other character in
+ * the script just waits that time.
+ *
+ * Game i of a run has the seed (-r or 1) + i for its blocks and random
+ * keys, and the games are shared out to -j threads that steal from
+ * each other when they run out, so the results of a run are the same
+ * with any number of threads.
+ */
+#define HEADLESS_KEY_MS     100     // virtual time per key
+#define HEADLESS_MAX_PIECES 100000  // ends a game that doesn't
+#define HEADLESS_SCRIPT     65536   // longest script
+#define HEADLESS_THREADS    64
+#define HEADLESS_HIST       32      // histogram buckets
+
+static unsigned char headless_script[HEADLESS_SCRIPT];
+static unsigned int  headless_script_len;
+
+struct headless_stats {
+  unsigned long games, pieces, lines;
+  unsigned long clears[5];              // locks that completed 0..4 rows
+  unsigned long score, score_max;
+  unsigned long level[HEADLESS_HIST];   // games by level reached
+  unsigned long scores[HEADLESS_HIST];  // games by score, bucket k: < 2^k
+  unsigned long rows[HEADLESS_HIST];    // games by rows completed, < 2^k
+  unsigned long digest;                 // of all game results, any order
+};
+
+// one thread of the batch: its games [next, end), its game and results
+struct headless_worker {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  unsigned long next, end;
+  struct tetris t;
+  struct headless_stats st;
+  uint32_t key_state;
+  unsigned int script_pos;
+  unsigned char plan[AUTOPLAY_KEYS]; // -a: moves of the current block
+  unsigned char plan_pos, plan_len, plan_due;
+};
+
+static struct headless_worker headless_workers[HEADLESS_THREADS];
+static unsigned int headless_threads;
+static unsigned int headless_seed;
+
+
+/**
+ * the next command key: from autoplay (waiting once the block is
+ * dropped), from the script, or a random one.
+ */
+unsigned char headless_key( struct headless_worker *w ) {
+  static const unsigned char keys[] = {
+    CMD_LEFT, CMD_RIGHT, CMD_ROTATE_CCW, CMD_ROTATE_CW, CMD_DOWN, CMD_DROP
+  };
+  unsigned char key;
+
+  if (AUTO_play) {
+    if (w->plan_due) {
+      w->plan_len = autoplay_keys(&w->t, w->plan);
+      w->plan_pos = 0;
+      w->plan_due = 0;
+    }
+    return w->plan_pos < w->plan_len ? w->plan[w->plan_pos++] : CMD_NONE;
+  }
+  if (headless_script_len == 0)
+    return keys[tetris_random(&w->key_state) % sizeof(keys)];
+  key = headless_script[w->script_pos++];
+  if (w->script_pos == headless_script_len) w->script_pos = 0;
+  return key;
+}
+
+
+/**
+ * count what a step did: new blocks and the rows each lock completed.
+ */
+void headless_count( struct headless_stats *st, const struct tetris *t, unsigned char ev ) {
+  if (ev & EV_NEW_BLOCK)
+    st->pieces++;
+  if (ev & EV_LOCKED) {
+    st->clears[ev & EV_ROWS ? t->cleared_n : 0]++;
+    if (ev & EV_ROWS) st->lines += t->cleared_n;
+  }
+}
+
+
+/**
+ * histogram bucket of v: its number of bits.
+ */
+unsigned char headless_bucket( unsigned long v ) {
+  unsigned char k;
+
+  for(k = 0; v > 0 && k < HEADLESS_HIST-1; k++)
+    v >>= 1;
+  return k;
+}
+
+
+/**
+ * play game number i to the end, the same way check_handle_command()
+ * does for a player, with the gravity steps due on the virtual clock
+ * after each key.
+ */
+void headless_game( struct headless_worker *w, unsigned long i ) {
+  struct tetris *t = &w->t;
+  struct headless_stats *st = &w->st;
+  unsigned long pieces, lines, h;
+  long now_ms, next_ms;
+  unsigned char ev;
+
+  tetris_seed(t, headless_seed + i);
+  tetris_new_game(t, MAX_level);
+  w->key_state = (headless_seed + i) * 2246822519u | 1; // never 0
+  w->script_pos = 0;
+  w->plan_due = 1;
+  pieces = st->pieces;
+  lines = st->lines;
+  now_ms = 0;
+  next_ms = t->step_ms;
+  ev = 0;
+  while( !(ev & EV_GAME_OVER) && st->pieces - pieces < HEADLESS_MAX_PIECES ) {
+    switch( headless_key(w) )
     {
-      set_next_step_timeout();
-      if(command == 0) // command has priority to timeout
-        state |= TIMEOUT; // timeout ignores command
+      case CMD_LEFT:       ev = tetris_left(t); break;
+      case CMD_RIGHT:      ev = tetris_right(t); break;
+      case CMD_ROTATE_CCW: ev = tetris_rotate(t, 1); break;
+      case CMD_ROTATE_CW:  ev = tetris_rotate(t, -1); break;
+      case CMD_DOWN:       ev = tetris_down(t); break;
+      case CMD_DROP:
+        ev = tetris_drop(t);
+        if (ev & EV_MOVED) // the block may still slide before it sticks
+          next_ms = now_ms + t->step_ms;
+        break;
+      default:             ev = 0; break;
+    }
+    headless_count(st, t, ev);
+    w->plan_due |= (ev & EV_NEW_BLOCK) != 0;
+
+    now_ms += HEADLESS_KEY_MS;
+    while( now_ms >= next_ms && !(ev & EV_GAME_OVER) ) {
+      ev = tetris_down(t);
+      headless_count(st, t, ev);
+      w->plan_due |= (ev & EV_NEW_BLOCK) != 0;
+      next_ms += t->step_ms;
+    }
+  }
+  lines = st->lines - lines;
+
+  st->games++;
+  st->score += t->score;
+  if (t->score > st->score_max) st->score_max = t->score;
+  st->level[t->level < HEADLESS_HIST ? t->level : HEADLESS_HIST-1]++;
+  st->scores[headless_bucket(t->score)]++;
+  st->rows[headless_bucket(lines)]++;
+
+  // added up, so the order the games ran in doesn't matter
+  h = (i * 2654435761UL) ^ (t->score * 40503UL) ^ (lines << 20) ^ (st->pieces - pieces);
+  st->digest += h * 0x9E3779B1UL;
+}
+
+
+/**
+ * take the second half of the games another thread has left.
+ * Returns 0 when there is nothing left anywhere.
+ */
+bit headless_steal( struct headless_worker *w ) {
+  struct headless_worker *v;
+  unsigned long n, from;
+  unsigned int k;
+
+  for(k = 1; k < headless_threads; k++) {
+    v = &headless_workers[(w - headless_workers + k) % headless_threads];
+    pthread_mutex_lock(&v->lock);
+    n = (v->end - v->next + 1) / 2;
+    v->end -= n;
+    from = v->end; // taken under the lock, another thief may move it
+    pthread_mutex_unlock(&v->lock);
+    if (n > 0) {
+      pthread_mutex_lock(&w->lock);
+      w->next = from;
+      w->end = from + n;
+      pthread_mutex_unlock(&w->lock);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+void *headless_thread( void *arg ) {
+  struct headless_worker *w = arg;
+  unsigned long i;
+
+  for(;;) {
+    pthread_mutex_lock(&w->lock);
+    if (w->next == w->end) {
+      pthread_mutex_unlock(&w->lock);
+      if (!headless_steal(w)) break;
+      continue;
+    }
+    i = w->next++;
+    pthread_mutex_unlock(&w->lock);
+    headless_game(w, i);
+  }
+  return NULL;
+}
+
+
+/**
+ * add the results of one thread to the total.
+ */
+void headless_merge( struct headless_stats *st, const struct headless_stats *s ) {
+  unsigned char k;
+
+  st->games += s->games;
+  st->pieces += s->pieces;
+  st->lines += s->lines;
+  for(k = 0; k < 5; k++)
+    st->clears[k] += s->clears[k];
+  st->score += s->score;
+  if (s->score_max > st->score_max) st->score_max = s->score_max;
+  for(k = 0; k < HEADLESS_HIST; k++) {
+    st->level[k] += s->level[k];
+    st->scores[k] += s->scores[k];
+    st->rows[k] += s->rows[k];
+  }
+  st->digest += s->digest;
+}
+
+
+/**
+ * print the non-empty ones of the n buckets h, with the bucket limits
+ * (2^k) or the bucket numbers.
+ */
+void headless_hist( const char *title, const unsigned long *h, unsigned char n, bit log2 ) {
+  char line[HEADLESS_HIST*32], *p;
+  unsigned char k;
+
+  p = text_str(line, title);
+  for(k = 0; k < n; k++) {
+    if (h[k] == 0) continue;
+    p = text_str(p, log2 ? "  <" : "  ");
+    p = text_num(p, log2 ? 1UL << k : k);
+    p = text_str(p, ": ");
+    p = text_num(p, h[k]);
+  }
+  *p = 0;
+  puts(line);
+}
+
+
+/**
+ * read the script file, returns 0 if there is none.
+ */
+bit headless_load( const char *script ) {
+  int fd, r;
+
+  fd = open(script, O_RDONLY);
+  r = fd < 0 ? -1 : read(fd, headless_script, sizeof(headless_script));
+  if (fd >= 0) close(fd);
+  if (r <= 0) {
+    perror(script);
+    return 0;
+  }
+  headless_script_len = r;
+  return 1;
+}
+
+
+/**
+ * run the given number of games on the given number of threads (and
+ * read the script file, if any), then report the speed and the
+ * statistics of the games.
+ */
+int headless_main( unsigned long games, long threads, unsigned int seed, const char *script ) {
+  struct headless_stats st;
+  char line[160], *p;
+  int64_t ns;
+  unsigned int i;
+
+  if (script && !headless_load(script))
+    return 1;
+
+  if (threads < 1) threads = 1;
+  if (threads > HEADLESS_THREADS) threads = HEADLESS_THREADS;
+  if ((unsigned long) threads > games) threads = games; // at least 1 here
+  headless_threads = threads;
+  headless_seed = seed;
+
+  ns = time_ns();
+  for(i = 0; i < threads; i++) { // equal shares to start with
+    pthread_mutex_init(&headless_workers[i].lock, NULL);
+    headless_workers[i].next = games * i / threads;
+    headless_workers[i].end = games * (i+1) / threads;
+  }
+  for(i = 1; i < threads; i++)
+    pthread_create(&headless_workers[i].thread, NULL, headless_thread, &headless_workers[i]);
+  headless_thread(&headless_workers[0]);
+  memset(&st, 0, sizeof(st));
+  for(i = 0; i < threads; i++) {
+    if (i > 0) pthread_join(headless_workers[i].thread, NULL);
+    headless_merge(&st, &headless_workers[i].st);
+  }
+  ns = time_ns() - ns;
+  if (ns == 0) ns = 1;
+
+  p = text_num(line, st.games);
+  p = text_str(p, " games, ");
+  p = text_num(p, st.pieces);
+  p = text_str(p, " pieces, ");
+  p = text_num(p, st.lines);
+  p = text_str(p, " rows in ");
+  p = text_num(p, ns / 1000000);
+  p = text_str(p, " ms on ");
+  p = text_num(p, threads);
+  p = text_str(p, " threads: ");
+  p = text_num(p, st.games * 1000000000LL / ns);
+  p = text_str(p, " games/s, ");
+  p = text_num(p, st.pieces * 1000000000LL / ns);
+  p = text_str(p, " pieces/s");
+  *p = 0;
+  puts(line);
+
+  p = text_str(line, "score: average ");
+  p = text_num(p, st.score / st.games);
+  p = text_str(p, ", best ");
+  p = text_num(p, st.score_max);
+  p = text_str(p, ", digest ");
+  p = text_num(p, st.digest & 0xffffffffUL);
+  *p = 0;
+  puts(line);
+
+  headless_hist("rows completed per block:", st.clears, 5, 0);
+  headless_hist("level reached:", st.level, HEADLESS_HIST, 0);
+  headless_hist("score:", st.scores, HEADLESS_HIST, 1);
+  headless_hist("rows per game:", st.rows, HEADLESS_HIST, 1);
+  return 0;
+}
+#endif /* USE_HEADLESS */
+
+
+#if USE_REPLAY
+/*
+ * replay playback (-P): the commands of a recording from the mapped
+ * file, to the terminal in real time (the ticks of a record spread
+ * evenly up to its command), or with --headless through the engine
+ * alone as fast as it goes, to verify the scores.
+ */
+static const unsigned char *replay_p, *replay_end; // the rest of the file
+
+// the record being played: its ticks, the ones done, command and time
+static unsigned long play_ticks, play_done, play_ms;
+static unsigned char play_cmd, play_loaded;
+static int64_t play_from_ns;
+
+
+/**
+ * the next varint of the file, 0 after its end.
+ */
+unsigned long replay_get( void ) {
+  unsigned long v;
+  unsigned char shift;
+
+  v = 0;
+  for(shift = 0; replay_p < replay_end && shift < 8*sizeof(v); shift += 7) {
+    v |= (unsigned long) (*replay_p & 0x7f) << shift;
+    if ((*replay_p++ & 0x80) == 0) break;
+  }
+  return v;
+}
+
+
+/**
+ * the next record: its ticks, command (0 at the end) and milliseconds.
+ */
+void replay_next( unsigned long *ticks, unsigned char *cmd, unsigned long *ms ) {
+  unsigned long v;
+
+  if (replay_p >= replay_end) {
+    *ticks = 0, *cmd = 0, *ms = 0; // truncated: the end
+    return;
+  }
+  v = replay_get();
+  *ticks = v >> 4;
+  *cmd = (v & 15) < sizeof(replay_cmds) ? replay_cmds[v & 15] : 0;
+  *ms = replay_get();
+}
+
+
+/**
+ * map a recording and take the seed and options from its header.
+ */
+bit replay_map( const char *file ) {
+  struct stat st;
+  void *map;
+  int fd;
+
+  fd = open(file, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(file);
+    return 0;
+  }
+  map = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (map == MAP_FAILED || st.st_size < 4 || memcmp(map, REPLAY_MAGIC, 4) != 0) {
+    puts("not a tetris recording");
+    return 0;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  replay_p = (const unsigned char *) map + 4;
+  replay_end = (const unsigned char *) map + st.st_size;
+  RAND_seed = replay_get();
+  MAX_level = replay_get();
+  console.INFINITE_time = (replay_get() & REPLAY_INFINITE) != 0;
+  return 1;
+}
+
+
+/**
+ * the isr() for playback: wait until the next tick or command of the
+ * recording is due and queue it, and everything else due by then.
+ * 'q' stops the playback.
+ */
+void replay_isr( void ) {
+  unsigned char buf[QUEUE_SIZE];
+  int64_t due, now;
+  int r, i;
+
+  while( queue_free() > 0 ) {
+    if (!play_loaded) {
+      replay_next(&play_ticks, &play_cmd, &play_ms);
+      play_done = 0;
+      play_loaded = 1;
     }
+    if (play_done < play_ticks)
+      due = play_from_ns + (int64_t) play_ms*1000000 * (play_done+1) / (play_ticks+1);
+    else
+      due = play_from_ns + (int64_t) play_ms*1000000;
+
+    now = time_ns();
+    if (due > now) {
+      if (ses->queue_head != ses->queue_tail) return; // play what is due first
+      r = wait_key((due - now + 999999) / 1000000);
+      if (r > 0) {
+        r = key_read(0, buf);
+        for(i = 0; i < r; i++)
+          if (buf[i] == CMD_QUIT || buf[i] == CMD_CTRLC)
+            queue_put(CMD_QUIT);
+        if (r > 0) return;
+      }
+      continue;
+    }
+
+    if (play_done < play_ticks) {
+      play_done++;
+      queue_put(CMD_TICK);
+      continue;
+    }
+    queue_put(play_cmd ? play_cmd : CMD_QUIT); // the end
+    play_from_ns = due;
+    play_loaded = 0;
+    if (!play_cmd) return;
   }
 }
 
 
+#if USE_HEADLESS
+/**
+ * one command of a recording in the engine, the same way
+ * check_handle_command() does it.
+ */
+unsigned char replay_step( struct tetris *t, unsigned char cmd ) {
+  unsigned char ev;
+
+  switch( cmd )
+  {
+    case CMD_TICK:
+    case CMD_DOWN:       return tetris_down(t);
+    case CMD_LEFT:       return tetris_left(t);
+    case CMD_RIGHT:      return tetris_right(t);
+    case CMD_ROTATE_CCW: return tetris_rotate(t, 1);
+    case CMD_ROTATE_CW:  return tetris_rotate(t, -1);
+    case CMD_DROP:
+      ev = tetris_drop(t);
+      if (console.INFINITE_time) // sticks at once
+        ev |= tetris_down(t);
+      return ev;
+  }
+  return 0;
+}
+
+
+/**
+ * print the result of one game of a recording.
+ */
+void replay_report( unsigned long game, const struct tetris *t, unsigned long pieces, bit over ) {
+  char line[120], *p;
+
+  p = text_str(line, "game ");
+  p = text_num(p, game);
+  p = text_str(p, ": score ");
+  p = text_num(p, t->score);
+  p = text_str(p, ", level ");
+  p = text_num(p, t->level);
+  p = text_str(p, ", ");
+  p = text_num(p, pieces);
+  p = text_str(p, over ? " pieces, game over" : " pieces, not finished");
+  *p = 0;
+  puts(line);
+}
+
+
+/**
+ * --headless -P: play the recording through the engine alone and
+ * report the score of each of its games.
+ */
+int replay_verify( void ) {
+  struct tetris t;
+  unsigned long ticks, ms, games, pieces, total;
+  unsigned char cmd, ev;
+  bit over;
+  char line[120], *p;
+  int64_t ns;
+
+  ns = time_ns();
+  tetris_seed(&t, RAND_seed);
+  tetris_new_game(&t, MAX_level);
+  games = 1;
+  pieces = 1;
+  total = 0;
+  over = 0;
+  for(;;) {
+    replay_next(&ticks, &cmd, &ms);
+    for( ; ticks > 0 && !over; ticks--) {
+      ev = replay_step(&t, CMD_TICK);
+      pieces += (ev & EV_NEW_BLOCK) != 0;
+      over = (ev & EV_GAME_OVER) != 0;
+    }
+    if (cmd == 0 || cmd == CMD_QUIT)
+      break;
+    if (cmd == CMD_START) { // the next game, also after giving up one
+      replay_report(games, &t, pieces, over);
+      total += pieces;
+      tetris_new_game(&t, MAX_level);
+      games++;
+      pieces = 1;
+      over = 0;
+    }
+    else if (!over) {
+      ev = replay_step(&t, cmd);
+      pieces += (ev & EV_NEW_BLOCK) != 0;
+      over = (ev & EV_GAME_OVER) != 0;
+    }
+  }
+  replay_report(games, &t, pieces, over);
+  total += pieces;
+  ns = time_ns() - ns;
+
+  p = text_num(line, games);
+  p = text_str(p, " games, ");
+  p = text_num(p, total);
+  p = text_str(p, " pieces verified in ");
+  p = text_num(p, ns / 1000);
+  p = text_str(p, " us");
+  *p = 0;
+  puts(line);
+  return 0;
+}
+#endif /* USE_HEADLESS */
+#endif /* USE_REPLAY */
+
+
+#if USE_HEADLESS && USE_STATS
+/*
+ * render benchmark (--bench): what the terminal modes cost in bytes.
+ * Each script of keys is played from the same seed in every mode, one
+ * key every HEADLESS_KEY_MS on a virtual clock (with -i no clock at
+ * all), and the frames go into bench_take() instead of a terminal.
+ * One line per mode, fields name=value: the bytes by kind, the escape
+ * bytes (all but the characters drawn), the first paint and the
+ * largest frame after it, which is what decides whether a slow link
+ * keeps up.
+ *
+ * --bench-stream reports a recorded stream the same way, with BENCH_MARK
+ * after each frame: the output of arhaic/tetris.c, see bench/bench.sh.
+ */
+#define BENCH_MARK 0xff // not in any terminal output
+
+static const char *bench_modes[] = {
+  "", "v", "m", "s", "c", "e", "sm", "sc", "vc"
+};
+
+
+/**
+ * print the report line of a run from stats and the bench counters.
+ */
+void bench_report( const char *build, const char *script, const char *mode,
+                   unsigned long frames, unsigned long paint, unsigned long worst ) {
+  static const char *cats[STAT_CATS] = { " goto=", " sgr=", " glyphs=", " scroll=", " other=" };
+  char line[400], *p;
+  unsigned long total;
+  unsigned char k;
+
+  total = 0;
+  for(k = 0; k < STAT_CATS; k++)
+    total += stats.bytes[k];
+  p = text_str(line, "bench build=");
+  p = text_str(p, build);
+  p = text_str(p, " script=");
+  p = text_str(p, script);
+  p = text_str(p, " mode=-");
+  p = text_str(p, mode);
+  p = text_str(p, " frames=");
+  p = text_num(p, frames);
+  p = text_str(p, " bytes=");
+  p = text_num(p, total);
+  p = text_str(p, " escape=");
+  p = text_num(p, total - stats.bytes[STAT_GLYPHS]);
+  for(k = 0; k < STAT_CATS; k++) {
+    p = text_str(p, cats[k]);
+    p = text_num(p, stats.bytes[k]);
+  }
+  p = text_str(p, " paint=");
+  p = text_num(p, paint);
+  p = text_str(p, " max_frame=");
+  p = text_num(p, worst);
+  p = text_str(p, " digest=");
+  p = text_num(p, bench_digest);
+  *p = 0;
+  puts(line);
+}
+
+
+/**
+ * play the loaded script in one mode (letters of the options) and
+ * report it.
+ */
+void bench_run( const char *script, const char *mode, bit infinite, unsigned int seed ) {
+  unsigned long frames, paint, worst, before;
+  unsigned int i;
+  const char *o;
+
+  ses = &console;
+  session_init(ses, -1);
+  for(o = mode; *o; o++)
+    switch( *o ) {
+      case 'v': ses->VT52_mode = 1; ses->VT100_scroll = ses->VT100_color = 0; break;
+      case 'm': ses->VT100_color = 0; break;
+      case 's': ses->VT100_scroll = 0; break;
+      case 'c': ses->DRAW_multi = 1; break;
+      case 'e': ses->VT100_rep = !ses->VT52_mode; break;
+    }
+  ses->INFINITE_time = infinite;
+  tetris_seed(&ses->game, seed);
+  memset(&stats, 0, sizeof(stats));
+  stat_esc = 0;
+  bench_digest = 2166136261UL;
+  clock_virtual_ns = 1000000000;
+
+  init_game();
+  vt100_flush();
+  paint = ses->link_total;
+  frames = worst = 0;
+  for(i = 0; i < headless_script_len && !session_over(); i++) {
+    clock_virtual_ns += (int64_t) HEADLESS_KEY_MS*1000000;
+    queue_key(headless_script[i]);
+    if (!ses->INFINITE_time)
+      queue_ticks();
+    if (ses->queue_head == ses->queue_tail) continue;
+    before = ses->link_total;
+    session_run();
+    frames++;
+    if (ses->link_total - before > worst) worst = ses->link_total - before;
+  }
+  clock_virtual_ns = 0;
+  bench_report(infinite ? "tetris-i" : "tetris", script, mode, frames, paint, worst);
+}
+
+
+int bench_main( int scripts, char **script, bit infinite, unsigned int seed ) {
+  unsigned char m;
+
+  STATS_on = 1;
+  EXIT_after_game_over = 0; // 's' in the script starts again
+  AUTO_play = 0;
+  for( ; scripts > 0; scripts--, script++ ) {
+    if (!headless_load(*script))
+      return 1;
+    for(m = 0; m < sizeof(bench_modes)/sizeof(bench_modes[0]); m++)
+      bench_run(*script, bench_modes[m], infinite, seed);
+  }
+  return 0;
+}
+
+
+/**
+ * report a stream recorded from stdin, frames end with BENCH_MARK.
+ */
+int bench_stream( const char *build, const char *script, const char *mode ) {
+  unsigned char buf[4096];
+  unsigned long frames, paint, worst, frame;
+  int r, i;
+
+  memset(&stats, 0, sizeof(stats));
+  bench_digest = 2166136261UL;
+  frames = paint = worst = frame = 0;
+  while( (r = read(0, buf, sizeof(buf))) > 0 )
+    for(i = 0; i < r; i++) {
+      if (buf[i] != BENCH_MARK) {
+        stat_byte(buf[i]);
+        bench_take(buf+i, 1);
+        frame++;
+        continue;
+      }
+      if (frames++ == 0)
+        paint = frame;
+      else if (frame > worst)
+        worst = frame;
+      frame = 0;
+    }
+  if (frames > 0) frames--; // the paint
+  bench_report(build, script, mode, frames, paint, worst);
+  return 0;
+}
+#endif /* USE_HEADLESS && USE_STATS */
+
+
 int main(int argc, char *argv[])
 {
   struct timespec tp;
+#if USE_SERVER
+  int server_port = 0;
+#endif
+#if USE_REPLAY
+  char *record = NULL, *play = NULL;
+#endif
+#if USE_LEADERS
+  char *leaders_file = NULL;
+#endif
+#if USE_HEADLESS
+  unsigned char headless = 0, bench = 0;
+  unsigned long headless_games = 1000;
+  long headless_threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+  session_init(&console, 1);
 
   for (; argc>1 && argv[1][0]=='-'; argc--, argv++)
   {
     switch (argv[1][1])
     {
       case 'v': // VT100 -> VT52
-        VT52_mode = 1;
-        VT100_scroll = 0;
-        VT100_color = 0;
+        ses->VT52_mode = 1;
+        ses->VT100_scroll = 0;
+        ses->VT100_color = 0;
         break;
 
       case 's': // VT100 no scroll controls (redraw board instead)
-        VT100_scroll = 0;
+        ses->VT100_scroll = 0;
         break;
 
       case 'm': // VT100 no color (monochrome)
-        VT100_color = 0;
+        ses->VT100_color = 0;
+        break;
+
+      case 'e': // VT100 compress runs with REP and ECH
+        ses->VT100_rep = 1;
         break;
 
       case 'c': // single-width chars (good for 8x8 font)
-        DRAW_multi = 1;
+        ses->DRAW_multi = 1;
         break;
 
       case 'r': // randomize, each run new random sequence
-        srand(time_ms());
+        RAND_seed = time_ns() / 1000000;
         break;
 
       case 'i': // think forever
-        INFINITE_time = 1;
+        ses->INFINITE_time = 1;
+        break;
+
+      case 'a': // autoplay
+        AUTO_play = 1;
         break;
 
+#if USE_STATS
+      case 't': // statistics to stderr at exit and on SIGUSR1
+        STATS_on = 1;
+        break;
+#endif
+
       case 'x': // don't leave game after game over
         EXIT_after_game_over = 0;
         break;
+
+      case 'b': // link speed in baud (default: measured)
+        if(argc > 2)
+        {
+          ses->link_rate = atol(argv[2]) / 10; // 8N1: 10 bits per byte
+          ses->link_fixed = ses->link_rate > 0;
+          argc--, argv++;
+        }
+        break;
+
+#if USE_SERVER
+      case 'S': // serve terminals on a TCP port (telnet)
+        if(argc > 2)
+        {
+          server_port = atoi(argv[2]);
+          argc--, argv++;
+        }
+        break;
+#endif
+
+#if USE_HEADLESS
+      case '-': // --headless: simulate games, no terminal
+        if(strcmp(argv[1], "--headless") == 0)
+          headless = 1;
+        else if(strcmp(argv[1], "--bench") == 0)
+          bench = 1;
+        else if(strcmp(argv[1], "--bench-stream") == 0)
+          bench = 2;
+        break;
+
+      case 'n': // games to simulate
+        if(argc > 2)
+        {
+          headless_games = atol(argv[2]);
+          if(headless_games < 1)
+            headless_games = 1;
+          argc--, argv++;
+        }
+        break;
+
+      case 'j': // simulation threads (default: all cores)
+        if(argc > 2)
+        {
+          headless_threads = atol(argv[2]);
+          argc--, argv++;
+        }
+        break;
+#endif
+
+#if USE_REPLAY
+      case 'R': // record the games
+        if(argc > 2)
+        {
+          record = argv[2];
+          argc--, argv++;
+        }
+        break;
+
+      case 'P': // play a recording back
+        if(argc > 2)
+        {
+          play = argv[2];
+          argc--, argv++;
+        }
+        break;
+#endif
+
+#if USE_LEADERS
+      case 'L': // leaderboard shared with other games
+        if(argc > 2)
+        {
+          leaders_file = argv[2];
+          argc--, argv++;
+        }
+        break;
+#endif
+
+      case 'f': // flush output after n bytes (default: once per frame)
+        if(argc > 2)
+        {
+          OUTBUF_limit = atoi(argv[2]);
+          if(OUTBUF_limit < 1 || OUTBUF_limit > OUTBUF_SIZE)
+            OUTBUF_limit = OUTBUF_SIZE;
+          argc--, argv++;
+        }
+        break;
       
       case 'h':
         puts("options:");
         puts(" -v  : VT100->VT52 mode (no colors)");
         puts(" -m  : VT100 monochrome (no colors)");
-        puts(" -s  : VT100 no scroll controls (remove line by redrawing monochrome board)");
+        puts(" -s  : VT100 no scroll controls (remove line by redrawing the board)");
+        puts(" -e  : VT100 compress runs with REP/ECH (xterm, linux console; not a real VT100)");
         puts(" -c  : single-char width for 8x8 font (instead of double-char for 8x8 font)");
         puts(" -r  : each run new random sequence (instead of always the same sequence)");
         puts(" -i  : infinite time (player can think forever)");
         puts(" -x  : don't exit after game over");
+        puts(" -a  : autoplay, the game plays itself (with -x: again and again; also --headless)");
+        puts(" -f n: flush output every n bytes (for slow serial links)");
+#if USE_STATS
+        puts(" -t  : statistics to stderr at exit and on SIGUSR1: bytes, syscalls, latency");
+#endif
+#if USE_SERVER
+        puts(" -S n: telnet server on TCP port n, the options above are the defaults");
+#endif
+#if USE_LEADERS
+        puts(" -L file: leaderboard of the best games, shared by all games using the file");
+#endif
+        puts(" -b n: terminal link speed in baud (default: measured), skip moves the link can't keep up with");
+#if USE_HEADLESS
+        puts(" --headless [file]: simulate games without a terminal, moves from the keys in file");
+        puts("     (played in a loop) or random, report games/s and the rows completed");
+        puts(" -n n: number of games to simulate (default: 1000)");
+#if USE_REPLAY
+        puts(" -R file: record the games to file");
+        puts(" -P file: play a recording back, with --headless: verify its scores at full speed");
+#endif
+        puts(" -j n: simulation threads (default: all cores), same results with any number");
+#if USE_STATS
+        puts(" --bench file...: bytes sent in each terminal mode for the keys in the files,");
+        puts("     one line per mode (with -i: no gravity), see make bench");
+#endif
+#endif
         puts("use the following keys to control the game:");
         puts(" 'j' : move current block left");
         puts(" 'l' : move current block right");
@@ -1571,13 +4014,79 @@ int main(int argc, char *argv[])
     }
   }
 
+  if(ses->VT52_mode)
+    ses->VT100_rep = 0;
+
+  tetris_init_tables();
+#if !TINY
+  vt100_init_tables();
+#endif
+#if USE_REPLAY
+  if(play && !replay_map(play))
+    return 1;
+#endif
+  tetris_seed(&console.game, RAND_seed);
+#if USE_STATS
+  if(STATS_on)
+    stats_start();
+#endif
+#if USE_HEADLESS && USE_STATS
+  if(bench == 1)
+    return bench_main(argc-1, argv+1, console.INFINITE_time, RAND_seed);
+  if(bench == 2 && argc > 3)
+    return bench_stream(argv[1], argv[2], argv[3]);
+#endif
+#if USE_HEADLESS && USE_REPLAY
+  if(headless && play)
+    return replay_verify();
+#endif
+#if USE_HEADLESS
+  if(headless)
+    return headless_main(headless_games, headless_threads, RAND_seed, argc > 1 ? argv[1] : NULL);
+#endif
+#if USE_LEADERS
+#if USE_REPLAY
+  if(play)
+    leaders_file = NULL; // played back, not a new game
+#endif
+  if(leaders_file && !leaders_open(leaders_file))
+    return 1;
+#endif
+#if USE_SERVER
+  if(server_port)
+    return server_main(server_port);
+#endif
+#if USE_REPLAY
+  if(record && !play && !replay_open(record))
+    return 1;
+  if(play)
+  {
+    EXIT_after_game_over = 0; // the recording says when it's over
+    AUTO_play = 0;
+  }
+#endif
   terminal_initialize();  // setup the rx/tx and timer parameters
   init_game();            // initialize the game-board and stuff
+#if USE_REPLAY
+  play_from_ns = time_ns();
+#endif
 
-  while( (state & GAME_OVER) == 0 || EXIT_after_game_over == 0 ) {
-    check_handle_command();
-    fflush(stdout);
+  do {
+    session_run();
+    if(session_over())
+      break;
+#if USE_STATS
+    if(stats_due)
+      stats_report();
+#endif
+#if USE_REPLAY
+    if(play)
+    {
+      replay_isr();
+      continue;
+    }
+#endif
     isr();
-  }
+  } while(1);
   return 0;
 }